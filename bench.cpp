@@ -0,0 +1,1689 @@
+/*
+ * Micro-benchmarks for the uthreads library.
+ *
+ * usage: uthreads_bench [--format=text|csv|json] [case...]
+ *
+ * Without case names every case runs; otherwise only those whose name starts with one of the arguments. Results go
+ * to stdout as aligned text, CSV with a header line, or JSON Lines (one object per result), each result carrying the
+ * case name, thread count, metric, value and unit, so runs can be compared across releases.
+ *
+ * uthread_init may only be called once per process, so every benchmark case runs in its own forked child. The exit
+ * status is 1 if any child failed, e.g. a correctness check such as alloc_ticks.
+ */
+#include "uthreads.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+// Quantum long enough that no preemption lands inside a measured loop
+#define BENCH_QUANTUM_USECS 1000000
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+enum format
+{
+	FORMAT_TEXT,
+	FORMAT_CSV,
+	FORMAT_JSON
+};
+
+static enum format g_format = FORMAT_TEXT;
+
+static void report(const char* bench, int threads, const char* metric, double value, const char* unit)
+{
+	switch (g_format)
+	{
+	case FORMAT_TEXT:
+		printf("%-24s threads=%-6d %-16s %12.1f %s\n", bench, threads, metric, value, unit);
+		break;
+	case FORMAT_CSV:
+		printf("%s,%d,%s,%.3f,%s\n", bench, threads, metric, value, unit);
+		break;
+	case FORMAT_JSON:
+		printf("{\"bench\":\"%s\",\"threads\":%d,\"metric\":\"%s\",\"value\":%.3f,\"unit\":\"%s\"}\n", bench, threads,
+		       metric, value, unit);
+		break;
+	}
+	fflush(stdout);
+}
+
+static void idle_thread(void)
+{
+	while (1)
+	{
+	}
+}
+
+/*
+ * Block and resume a READY thread picked from the middle of the run list. The cost should not depend on how many
+ * other threads are queued.
+ */
+static void bench_block_resume(int nthreads)
+{
+	const int iters = 200000;
+	uthread_init(BENCH_QUANTUM_USECS);
+	uthread_set_thread_limit(nthreads);
+	for (int i = 1; i < nthreads; i++)
+	{
+		uthread_spawn(idle_thread);
+	}
+
+	int victim = nthreads / 2;
+	double start = now_ns();
+	for (int i = 0; i < iters; i++)
+	{
+		uthread_block(victim);
+		uthread_resume(victim);
+	}
+	double elapsed = now_ns() - start;
+
+	report("block_resume_ready", nthreads, "ns/op", elapsed / iters, "ns");
+}
+
+/*
+ * Spawn a thread and terminate it again with nthreads-1 others alive, so tid and stack-slot lookup run against a
+ * nearly full table.
+ */
+static void bench_spawn_terminate(int nthreads)
+{
+	const int iters = 200000;
+	uthread_init(BENCH_QUANTUM_USECS);
+	uthread_set_thread_limit(nthreads);
+	for (int i = 1; i < nthreads - 1; i++)
+	{
+		uthread_spawn(idle_thread);
+	}
+
+	double start = now_ns();
+	for (int i = 0; i < iters; i++)
+	{
+		uthread_terminate(uthread_spawn(idle_thread));
+	}
+	double elapsed = now_ns() - start;
+
+	report("spawn_terminate", nthreads, "ns/op", elapsed / iters, "ns");
+}
+
+/*
+ * Context-switch cost of a preemption. Switches are forced by raising SIGVTALRM synchronously, so every raise is one
+ * full pass through the timer handler and the scheduler, as a quantum expiring would take; yield_pingpong measures
+ * the voluntary path.
+ */
+static volatile int g_switch_done;
+
+static void signal_switch_thread(void)
+{
+	while (!g_switch_done)
+	{
+		raise(SIGVTALRM);
+	}
+	while (1)
+	{
+	}
+}
+
+static void bench_switch_signal(int nthreads)
+{
+	const int iters = 100000;
+	uthread_init(BENCH_QUANTUM_USECS);
+	uthread_set_thread_limit(nthreads);
+	for (int i = 1; i < nthreads; i++)
+	{
+		uthread_spawn(signal_switch_thread);
+	}
+
+	int q0 = uthread_get_total_quantums();
+	double start = now_ns();
+	for (int i = 0; i < iters / nthreads; i++)
+	{
+		raise(SIGVTALRM);
+	}
+	double elapsed = now_ns() - start;
+	g_switch_done = 1;
+	int switches = uthread_get_total_quantums() - q0;
+
+	report("switch_signal", nthreads, "ns/switch", elapsed / switches, "ns");
+}
+
+/*
+ * Two threads hand the CPU to each other with uthread_resume + uthread_block(self); the main thread is the third
+ * member of the ring and passes its turn on with a raised SIGVTALRM. Two of every three switches are voluntary.
+ */
+static int g_ping_tid;
+static int g_pong_tid;
+
+static void ping_thread(void)
+{
+	while (1)
+	{
+		uthread_resume(g_pong_tid);
+		uthread_block(g_ping_tid);
+	}
+}
+
+static void pong_thread(void)
+{
+	while (1)
+	{
+		uthread_resume(g_ping_tid);
+		uthread_block(g_pong_tid);
+	}
+}
+
+static void bench_switch_block_resume(int nthreads)
+{
+	const int rounds = 50000;
+	uthread_init(BENCH_QUANTUM_USECS);
+	g_ping_tid = uthread_spawn(ping_thread);
+	g_pong_tid = uthread_spawn(pong_thread);
+
+	int q0 = uthread_get_total_quantums();
+	double start = now_ns();
+	for (int i = 0; i < rounds; i++)
+	{
+		raise(SIGVTALRM);
+	}
+	double elapsed = now_ns() - start;
+	int switches = uthread_get_total_quantums() - q0;
+
+	report("switch_block_resume", 3, "ns/switch", elapsed / switches, "ns");
+}
+
+/*
+ * Preemption latency. Two CPU-bound threads stamp the time in a loop under a wall-clock quantum; the first stamp a
+ * thread takes after getting the CPU back, minus the last one the other thread took, is the whole cost of a
+ * preemption: signal delivery, the handler, the scheduler and the switch.
+ */
+#define PREEMPT_QUANTUM_USECS 200
+#define PREEMPT_SAMPLES 1000
+
+static double g_preempt[PREEMPT_SAMPLES];
+static volatile int g_preempt_count;
+static volatile int g_preempt_owner;
+static volatile double g_preempt_last[2];   // Each thread's latest stamp, written only by that thread
+
+static int compare_double(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+static void preempt_loop(int self)
+{
+	while (g_preempt_count < PREEMPT_SAMPLES)
+	{
+		// Stamp only after the check, so that a stamp taken before a preemption is never compared
+		if (g_preempt_owner != self)
+		{
+			double t = now_ns();
+			if (g_preempt_last[1 - self] != 0)
+			{
+				g_preempt[g_preempt_count++] = t - g_preempt_last[1 - self];
+			}
+			g_preempt_owner = self;
+			g_preempt_last[self] = t;
+			continue;
+		}
+		g_preempt_last[self] = now_ns();
+	}
+}
+
+static void preempt_thread(void)
+{
+	preempt_loop(uthread_get_tid());
+	while (1)
+	{
+	}
+}
+
+static void bench_switch_preempt(int nthreads)
+{
+	uthread_init_attr_t attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.clock = UTHREAD_CLOCK_REAL;
+	uthread_init_ex(PREEMPT_QUANTUM_USECS, &attr);
+	uthread_spawn(preempt_thread);
+	preempt_loop(0);
+
+	qsort(g_preempt, PREEMPT_SAMPLES, sizeof(double), compare_double);
+	report("switch_preempt", nthreads, "p50", g_preempt[PREEMPT_SAMPLES / 2], "ns");
+	report("switch_preempt", nthreads, "p99", g_preempt[PREEMPT_SAMPLES * 99 / 100], "ns");
+}
+
+/*
+ * Channel throughput. Ping-pong bounces one message between the main thread and a partner over two unbuffered
+ * channels, so every message is a direct handoff plus a switch. Fan-in has several producers feeding one buffered
+ * channel drained by the main thread. The traced ping-pong runs with uthread_trace_start on, to show what recording
+ * every switch costs.
+ */
+static uthread_chan_t* g_ping;
+static uthread_chan_t* g_pong;
+static int g_trace;
+
+static void echo_thread(void)
+{
+	void* msg;
+	while (uthread_chan_recv(g_ping, &msg) == 0)
+	{
+		uthread_chan_send(g_pong, msg);
+	}
+	while (1)
+	{
+	}
+}
+
+static void bench_chan_pingpong(int nthreads)
+{
+	const int iters = 200000;
+	uthread_init(BENCH_QUANTUM_USECS);
+	if (g_trace)
+	{
+		uthread_trace_start(0);
+	}
+	g_ping = uthread_chan_create(0);
+	g_pong = uthread_chan_create(0);
+	uthread_spawn(echo_thread);
+
+	long token = 0;
+	double start = now_ns();
+	for (int i = 0; i < iters; i++)
+	{
+		void* reply;
+		uthread_chan_send(g_ping, (void*)token);
+		uthread_chan_recv(g_pong, &reply);
+		token = (long)reply + 1;
+	}
+	double elapsed = now_ns() - start;
+
+	const char* name = g_trace ? "chan_pingpong_traced" : "chan_pingpong";
+	report(name, 2, "msgs/sec", 2.0 * iters / (elapsed / 1e9), "msg/s");
+	report(name, 2, "ns/roundtrip", elapsed / iters, "ns");
+}
+
+static uthread_chan_t* g_fanin;
+
+static void fanin_producer(void)
+{
+	long seq = 0;
+	while (uthread_chan_send(g_fanin, (void*)seq) == 0)
+	{
+		seq++;
+	}
+	while (1)
+	{
+	}
+}
+
+static void bench_chan_fanin(int nthreads)
+{
+	const int iters = 500000;
+	uthread_init(BENCH_QUANTUM_USECS);
+	g_fanin = uthread_chan_create(64);
+	for (int i = 1; i < nthreads; i++)
+	{
+		uthread_spawn(fanin_producer);
+	}
+
+	double start = now_ns();
+	for (int i = 0; i < iters; i++)
+	{
+		void* msg;
+		uthread_chan_recv(g_fanin, &msg);
+	}
+	double elapsed = now_ns() - start;
+
+	report("chan_fanin", nthreads, "msgs/sec", iters / (elapsed / 1e9), "msg/s");
+}
+
+/*
+ * The epoll reactor, driven only through uthread_read/uthread_write/uthread_accept/uthread_connect. Ping-pong
+ * bounces one byte between the main thread and an echo thread over a socketpair, or over two pipes, while nthreads-2
+ * other threads stay parked reading idle channels; each round trip is two parked reads woken through epoll. Half of
+ * the idle readers park on fds near RLIMIT_NOFILE after the low ones are already waiting, so the reactor's fd table
+ * grows under parked threads. Afterwards a quarter of the readers are terminated while parked and their channels
+ * written anyway, and every other reader must still wake with its byte. Fan-in has (nthreads-1)/2 clients connect
+ * to a loopback listener, each served by its own handler thread. A hang fails the case through alarm(2).
+ */
+#define IO_ROUNDS 50000
+#define IO_TIMEOUT_SECS 30
+
+struct io_idle
+{
+	int rd;
+	int wr;
+	int tid;
+	volatile int got;   // Bytes the reader got, or -1 if its read failed
+};
+
+static int g_io_pipes;
+static int g_io_echo_rd;
+static int g_io_echo_wr;
+static struct io_idle* g_io_idle;
+static int g_io_conns[MAX_THREAD_NUM];   // Connection of each handler thread, by tid
+static uthread_sem_t g_io_woken;
+
+// A pipe, or a socketpair used in one direction, as fds[0] for reading and fds[1] for writing
+static void io_channel(int fds[2])
+{
+	int rc = g_io_pipes ? pipe2(fds, O_NONBLOCK | O_CLOEXEC)
+	                    : socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds);
+	if (rc < 0)
+	{
+		perror("io_channel");
+		exit(1);
+	}
+}
+
+// Read or write exactly count bytes, returning -1 on failure or end of file
+static int io_full(int fd, char* buf, size_t count, int writing)
+{
+	while (count > 0)
+	{
+		ssize_t n = writing ? uthread_write(fd, buf, count) : uthread_read(fd, buf, count);
+		if (n <= 0)
+		{
+			return -1;
+		}
+		buf += n;
+		count -= n;
+	}
+	return 0;
+}
+
+static void io_echo_thread(void)
+{
+	char b;
+	while (uthread_read(g_io_echo_rd, &b, 1) == 1)
+	{
+		uthread_write(g_io_echo_wr, &b, 1);
+	}
+	while (1)
+	{
+	}
+}
+
+static void io_idle_reader(void)
+{
+	int tid = uthread_get_tid();
+	struct io_idle* c = g_io_idle;
+	while (c->tid != tid)
+	{
+		c++;
+	}
+	char b;
+	c->got = (int)uthread_read(c->rd, &b, 1);
+	uthread_sem_post(&g_io_woken);
+	uthread_terminate(tid);
+}
+
+static void bench_io_pingpong(int nthreads)
+{
+	alarm(IO_TIMEOUT_SECS);
+	uthread_init(BENCH_QUANTUM_USECS);
+	uthread_sem_init(&g_io_woken, 0);
+	const char* name = g_io_pipes ? "io_pingpong_pipe" : "io_pingpong_socketpair";
+
+	int nidle = nthreads - 2;
+	g_io_idle = (struct io_idle*)calloc(nidle > 0 ? nidle : 1, sizeof(struct io_idle));
+	for (int i = 0; i < nidle; i++)
+	{
+		int fds[2];
+		io_channel(fds);
+		g_io_idle[i].rd = fds[0];
+		g_io_idle[i].wr = fds[1];
+	}
+
+	// Park the low-fd readers first, then move the rest to the top of the fd range and park those
+	struct rlimit lim;
+	getrlimit(RLIMIT_NOFILE, &lim);
+	int high = (int)(lim.rlim_cur > 65536 ? 65536 : lim.rlim_cur) - 1;
+	for (int i = 0; i < nidle; i++)
+	{
+		if (i == nidle / 2)
+		{
+			raise(SIGVTALRM);
+		}
+		if (i >= nidle / 2)
+		{
+			int fd = fcntl(g_io_idle[i].rd, F_DUPFD_CLOEXEC, high - (nidle - i));
+			if (fd < 0)
+			{
+				perror("fcntl");
+				exit(1);
+			}
+			close(g_io_idle[i].rd);
+			g_io_idle[i].rd = fd;
+		}
+		g_io_idle[i].tid = uthread_spawn(io_idle_reader);
+	}
+	raise(SIGVTALRM);
+
+	int main_fds[2];
+	int echo_fds[2];
+	io_channel(main_fds);
+	if (g_io_pipes)
+	{
+		io_channel(echo_fds);
+		g_io_echo_rd = main_fds[0];
+		g_io_echo_wr = echo_fds[1];
+	}
+	else
+	{
+		// One socketpair carries both directions
+		echo_fds[0] = main_fds[1];
+		g_io_echo_rd = g_io_echo_wr = main_fds[0];
+	}
+	int rd = echo_fds[0];
+	int wr = main_fds[1];
+	uthread_spawn(io_echo_thread);
+
+	double start = now_ns();
+	for (int i = 0; i < IO_ROUNDS; i++)
+	{
+		char b = (char)i;
+		if (uthread_write(wr, &b, 1) != 1 || uthread_read(rd, &b, 1) != 1 || b != (char)i)
+		{
+			fprintf(stderr, "%s: echo failed in round %d\n", name, i);
+			exit(1);
+		}
+	}
+	double elapsed = now_ns() - start;
+	report(name, nthreads, "ns/roundtrip", elapsed / IO_ROUNDS, "ns");
+
+	// Readers terminated while parked must be gone from their fd's queue; the rest must all wake
+	int nkilled = nidle / 4;
+	for (int i = 0; i < nkilled; i++)
+	{
+		uthread_terminate(g_io_idle[i].tid);
+	}
+	for (int i = 0; i < nidle; i++)
+	{
+		char b = 1;
+		uthread_write(g_io_idle[i].wr, &b, 1);
+	}
+	for (int i = nkilled; i < nidle; i++)
+	{
+		uthread_sem_wait(&g_io_woken);
+	}
+	for (int i = 0; i < nidle; i++)
+	{
+		if (g_io_idle[i].got != (i < nkilled ? 0 : 1))
+		{
+			fprintf(stderr, "%s: reader %d on fd %d got %d bytes\n", name, i, g_io_idle[i].rd, g_io_idle[i].got);
+			exit(1);
+		}
+	}
+}
+
+static struct sockaddr_in g_io_addr;
+static volatile int g_io_served;
+
+static void io_client_thread(void)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	int tid = uthread_get_tid();
+	int reply = -1;
+	if (fd >= 0 && uthread_connect(fd, (struct sockaddr*)&g_io_addr, sizeof(g_io_addr)) == 0 &&
+	    io_full(fd, (char*)&tid, sizeof(tid), 1) == 0 && io_full(fd, (char*)&reply, sizeof(reply), 0) == 0 &&
+	    reply == tid)
+	{
+		g_io_served++;
+	}
+	close(fd);
+	uthread_sem_post(&g_io_woken);
+	uthread_terminate(tid);
+}
+
+static void io_handler_thread(void)
+{
+	int tid = uthread_get_tid();
+	int fd = g_io_conns[tid];
+	int msg;
+	if (io_full(fd, (char*)&msg, sizeof(msg), 0) == 0)
+	{
+		io_full(fd, (char*)&msg, sizeof(msg), 1);
+	}
+	close(fd);
+	uthread_terminate(tid);
+}
+
+static void bench_io_fanin(int nthreads)
+{
+	alarm(IO_TIMEOUT_SECS);
+	uthread_init(BENCH_QUANTUM_USECS);
+	uthread_sem_init(&g_io_woken, 0);
+	int nclients = (nthreads - 1) / 2;
+
+	int lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	socklen_t len = sizeof(g_io_addr);
+	g_io_addr.sin_family = AF_INET;
+	g_io_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (lfd < 0 || bind(lfd, (struct sockaddr*)&g_io_addr, sizeof(g_io_addr)) < 0 || listen(lfd, SOMAXCONN) < 0 ||
+	    getsockname(lfd, (struct sockaddr*)&g_io_addr, &len) < 0)
+	{
+		perror("listen");
+		exit(1);
+	}
+
+	double start = now_ns();
+	for (int i = 0; i < nclients; i++)
+	{
+		uthread_spawn(io_client_thread);
+	}
+	for (int i = 0; i < nclients; i++)
+	{
+		int fd = uthread_accept(lfd, NULL, NULL);
+		if (fd < 0)
+		{
+			perror("uthread_accept");
+			exit(1);
+		}
+		g_io_conns[uthread_spawn(io_handler_thread)] = fd;
+	}
+	for (int i = 0; i < nclients; i++)
+	{
+		uthread_sem_wait(&g_io_woken);
+	}
+	double elapsed = now_ns() - start;
+
+	report("io_fanin", nthreads, "conns/sec", nclients / (elapsed / 1e9), "conn/s");
+	if (g_io_served != nclients)
+	{
+		fprintf(stderr, "io_fanin: %d of %d clients got their echo\n", g_io_served, nclients);
+		exit(1);
+	}
+}
+
+/*
+ * Producer/consumer handoff with other threads READY: the main thread posts a request and gives up the CPU, and the
+ * consumer answers it and gives the CPU back. With uthread_yield each of the nthreads-2 bystanders gets a turn in
+ * between, so a round trip grows with their number; uthread_yield_to hands the CPU straight across and the
+ * bystanders only run once the quantum ends.
+ */
+#define YIELD_ROUNDS 50000
+
+static int g_yield_directed;
+static volatile int g_yield_request;
+
+static void give_up_cpu(int tid)
+{
+	if (g_yield_directed)
+	{
+		uthread_yield_to(tid);
+	}
+	else
+	{
+		uthread_yield();
+	}
+}
+
+static void yield_consumer_thread(void)
+{
+	while (1)
+	{
+		g_yield_request = 0;
+		give_up_cpu(0);
+	}
+}
+
+static void yield_bystander_thread(void)
+{
+	while (1)
+	{
+		uthread_yield();
+	}
+}
+
+static void bench_yield_pingpong(int nthreads)
+{
+	uthread_init(BENCH_QUANTUM_USECS);
+	uthread_set_thread_limit(nthreads);
+	int consumer = uthread_spawn(yield_consumer_thread);
+	for (int i = 2; i < nthreads; i++)
+	{
+		uthread_spawn(yield_bystander_thread);
+	}
+
+	double start = now_ns();
+	for (int i = 0; i < YIELD_ROUNDS; i++)
+	{
+		g_yield_request = 1;
+		while (g_yield_request)
+		{
+			give_up_cpu(consumer);
+		}
+	}
+	double elapsed = now_ns() - start;
+
+	report(g_yield_directed ? "yield_to_pingpong" : "yield_pingpong", nthreads, "ns/roundtrip",
+	       elapsed / YIELD_ROUNDS, "ns");
+}
+
+/*
+ * Throughput of short tasks, queued in batches of TASK_BATCH: on a pool of nthreads-1 recycled workers, and with a
+ * fresh uthread_spawn_arg thread per task that ends when the task returns. The main thread hands the CPU on with a
+ * raised SIGVTALRM until the batch is done.
+ */
+#define TASK_COUNT 200000
+#define TASK_BATCH 64
+
+static volatile int g_tasks_done;
+
+static void count_task(void* arg)
+{
+	(void)arg;
+	g_tasks_done++;
+}
+
+static void bench_pool_tasks(int nthreads)
+{
+	uthread_init(BENCH_QUANTUM_USECS);
+	uthread_pool_t* pool = uthread_pool_create(nthreads - 1);
+
+	double start = now_ns();
+	for (int i = 0; i < TASK_COUNT; i += TASK_BATCH)
+	{
+		for (int j = 0; j < TASK_BATCH; j++)
+		{
+			uthread_pool_submit(pool, count_task, NULL);
+		}
+		while (g_tasks_done < i + TASK_BATCH)
+		{
+			raise(SIGVTALRM);
+		}
+	}
+	double elapsed = now_ns() - start;
+	uthread_pool_destroy(pool);
+
+	report("tasks_pool", nthreads, "tasks/sec", TASK_COUNT / (elapsed / 1e9), "task/s");
+}
+
+static void bench_spawn_tasks(int nthreads)
+{
+	uthread_init(BENCH_QUANTUM_USECS);
+
+	double start = now_ns();
+	for (int i = 0; i < TASK_COUNT; i += TASK_BATCH)
+	{
+		for (int j = 0; j < TASK_BATCH; j++)
+		{
+			uthread_spawn_arg(count_task, NULL);
+		}
+		while (g_tasks_done < i + TASK_BATCH)
+		{
+			raise(SIGVTALRM);
+		}
+	}
+	double elapsed = now_ns() - start;
+
+	report("tasks_spawn", nthreads, "tasks/sec", TASK_COUNT / (elapsed / 1e9), "task/s");
+}
+
+/*
+ * M:N scaling: the same load run by g_mn_workers kernel threads (uthread_init_attr_t.workers), 1 being the plain
+ * single-threaded scheduler. mn_cpu gives each of nthreads-1 joinable threads a fixed amount of arithmetic and
+ * measures how fast all of it gets done; mn_pingpong runs (nthreads-1)/2 pairs that hand a semaphore back and forth,
+ * which exercises wakeups and stealing between workers. Gains need at least as many CPUs as workers.
+ */
+#define MN_QUANTUM_USECS 1000
+#define MN_WORK 20000000L
+#define MN_ROUNDS 20000
+#define MN_MAX_THREADS 64
+
+static int g_mn_workers;
+static int g_mn_tids[MN_MAX_THREADS];
+static uthread_sem_t g_mn_sems[MN_MAX_THREADS];
+
+static void mn_init()
+{
+	uthread_init_attr_t attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.clock = UTHREAD_CLOCK_MONOTONIC;
+	attr.workers = g_mn_workers;
+	if (uthread_init_ex(MN_QUANTUM_USECS, &attr) < 0)
+	{
+		exit(1);
+	}
+}
+
+static void mn_spawn(int i, thread_entry_point entry)
+{
+	uthread_attr_t attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.joinable = 1;
+	g_mn_tids[i] = uthread_spawn_ex(entry, &attr);
+}
+
+static void mn_join_all(int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		uthread_join(g_mn_tids[i], NULL);
+	}
+}
+
+static void mn_cpu_thread(void)
+{
+	volatile long x = 0;
+	for (long i = 0; i < MN_WORK; i++)
+	{
+		x = x + 1;
+	}
+}
+
+static void bench_mn_cpu(int nthreads)
+{
+	mn_init();
+	double start = now_ns();
+	for (int i = 0; i < nthreads - 1; i++)
+	{
+		mn_spawn(i, mn_cpu_thread);
+	}
+	mn_join_all(nthreads - 1);
+	double elapsed = now_ns() - start;
+
+	char name[32];
+	snprintf(name, sizeof(name), "mn_cpu_w%d", g_mn_workers);
+	report(name, nthreads, "work/sec", MN_WORK * (nthreads - 1) / (elapsed / 1e3), "M/s");
+}
+
+// Even threads post their partner's semaphore and wait on their own; odd threads do the reverse
+static void mn_pingpong_thread(void)
+{
+	int tid = uthread_get_tid();
+	int me = 0;
+	while (g_mn_tids[me] != tid)
+	{
+		me++;
+	}
+	for (int i = 0; i < MN_ROUNDS; i++)
+	{
+		if (me % 2 == 0)
+		{
+			uthread_sem_post(&g_mn_sems[me + 1]);
+			uthread_sem_wait(&g_mn_sems[me]);
+		}
+		else
+		{
+			uthread_sem_wait(&g_mn_sems[me]);
+			uthread_sem_post(&g_mn_sems[me - 1]);
+		}
+	}
+}
+
+static void bench_mn_pingpong(int nthreads)
+{
+	int n = (nthreads - 1) / 2 * 2;
+	mn_init();
+	for (int i = 0; i < n; i++)
+	{
+		uthread_sem_init(&g_mn_sems[i], 0);
+	}
+	uthread_preempt_disable();
+	for (int i = 0; i < n; i++)
+	{
+		mn_spawn(i, mn_pingpong_thread);
+	}
+	double start = now_ns();
+	uthread_preempt_enable();
+	mn_join_all(n);
+	double elapsed = now_ns() - start;
+
+	char name[32];
+	snprintf(name, sizeof(name), "mn_pingpong_w%d", g_mn_workers);
+	report(name, nthreads, "handoffs/sec", 2.0 * MN_ROUNDS * (n / 2) / (elapsed / 1e9), "op/s");
+}
+
+/*
+ * Wakeups from a pthread outside the library, as a completion callback would post them: a uthread hands a request
+ * to the pthread and blocks, and the pthread answers with uthread_resume_from_foreign. Every other thread is
+ * blocked meanwhile, so each wakeup has to kick an idle scheduler (through its eventfd, or the worker futex in M:N
+ * mode); the time per round trip also covers the two kernel threads taking turns on the CPU.
+ */
+#define FOREIGN_ROUNDS 50000
+
+static int g_foreign_request;
+static int g_foreign_done;
+static int g_foreign_tid;
+
+static void* foreign_completer(void* arg)
+{
+	(void)arg;
+	while (!__atomic_load_n(&g_foreign_done, __ATOMIC_ACQUIRE))
+	{
+		if (__atomic_exchange_n(&g_foreign_request, 0, __ATOMIC_ACQ_REL))
+		{
+			uthread_resume_from_foreign(g_foreign_tid);
+		}
+		else
+		{
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+static void foreign_client_thread(void)
+{
+	int tid = uthread_get_tid();
+	for (int i = 0; i < FOREIGN_ROUNDS; i++)
+	{
+		// Request and block with preemption off, so the wakeup cannot arrive before the thread is blocked
+		uthread_preempt_disable();
+		__atomic_store_n(&g_foreign_request, 1, __ATOMIC_RELEASE);
+		uthread_block(tid);
+		uthread_preempt_enable();
+	}
+	__atomic_store_n(&g_foreign_done, 1, __ATOMIC_RELEASE);
+}
+
+static void bench_foreign_wakeup(int nthreads)
+{
+	mn_init();
+	mn_spawn(0, foreign_client_thread);
+	g_foreign_tid = g_mn_tids[0];
+
+	pthread_t completer;
+	double start = now_ns();
+	pthread_create(&completer, NULL, foreign_completer, NULL);
+	mn_join_all(1);
+	double elapsed = now_ns() - start;
+	pthread_join(completer, NULL);
+
+	char name[32];
+	snprintf(name, sizeof(name), "foreign_wakeup_w%d", g_mn_workers);
+	report(name, nthreads, "ns/wakeup", elapsed / FOREIGN_ROUNDS, "ns");
+}
+
+/*
+ * Scaling with the number of live threads: spawn nthreads-1 threads, run a few full round-robin passes over all of
+ * them and terminate them again. Memory per thread is the growth of the resident set once every thread has run, so
+ * it covers the TCB, the touched part of the stack and the signal frame pushed on it.
+ */
+#define SCALE_STACK_SIZE (16 * 1024)
+
+static long rss_kib()
+{
+	long pages = 0, resident = 0;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if (f != NULL)
+	{
+		if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+		{
+			resident = 0;
+		}
+		fclose(f);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void bench_scale(int nthreads)
+{
+	const int target_switches = 300000;
+	uthread_init(BENCH_QUANTUM_USECS);
+	uthread_set_thread_limit(nthreads);
+	uthread_attr_t attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.stack_size = SCALE_STACK_SIZE;
+
+	long rss0 = rss_kib();
+	double start = now_ns();
+	for (int i = 1; i < nthreads; i++)
+	{
+		if (uthread_spawn_ex(signal_switch_thread, &attr) < 0)
+		{
+			fprintf(stderr, "spawn failed at %d threads\n", i);
+			exit(1);
+		}
+	}
+	double spawn_elapsed = now_ns() - start;
+
+	int rounds = target_switches / nthreads > 0 ? target_switches / nthreads : 1;
+	int q0 = uthread_get_total_quantums();
+	start = now_ns();
+	for (int i = 0; i < rounds; i++)
+	{
+		raise(SIGVTALRM);
+	}
+	double switch_elapsed = now_ns() - start;
+	int switches = uthread_get_total_quantums() - q0;
+	long rss1 = rss_kib();
+	g_switch_done = 1;
+
+	start = now_ns();
+	for (int tid = 1; tid < nthreads; tid++)
+	{
+		uthread_terminate(tid);
+	}
+	double terminate_elapsed = now_ns() - start;
+
+	report("scale_spawn", nthreads, "ns/thread", spawn_elapsed / (nthreads - 1), "ns");
+	report("scale_switch", nthreads, "ns/switch", switch_elapsed / switches, "ns");
+	report("scale_terminate", nthreads, "ns/thread", terminate_elapsed / (nthreads - 1), "ns");
+	report("scale_memory", nthreads, "bytes/thread", (rss1 - rss0) * 1024.0 / (nthreads - 1), "B");
+}
+
+/*
+ * Wakeup latency of a short request handler competing with CPU-bound threads. The handler sleeps for one quantum
+ * and records how long uthread_sleep took in wall-clock time; everything beyond the sleep itself is time spent
+ * waiting for the CPU. Under round robin that wait grows with the number of hogs; under MLFQ the hogs sink to the
+ * lower levels and the handler runs as soon as it is due.
+ */
+#define LATENCY_QUANTUM_USECS 1000
+#define LATENCY_SAMPLES 200
+
+static double g_latency[LATENCY_SAMPLES];
+static volatile int g_latency_done;
+
+static void handler_thread(void)
+{
+	for (int i = 0; i < LATENCY_SAMPLES; i++)
+	{
+		double start = now_ns();
+		uthread_sleep(1);
+		g_latency[i] = now_ns() - start;
+	}
+	g_latency_done = 1;
+	uthread_block(uthread_get_tid());
+}
+
+static void bench_wakeup_latency(int nthreads, uthread_sched_t sched)
+{
+	uthread_init_attr_t attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.clock = UTHREAD_CLOCK_REAL;
+	attr.sched = sched;
+	uthread_init_ex(LATENCY_QUANTUM_USECS, &attr);
+	for (int i = 2; i < nthreads; i++)
+	{
+		uthread_spawn(idle_thread);
+	}
+	uthread_spawn(handler_thread);
+	while (!g_latency_done)
+	{
+	}
+
+	qsort(g_latency, LATENCY_SAMPLES, sizeof(double), compare_double);
+	const char* name = sched == UTHREAD_SCHED_MLFQ ? "wakeup_latency_mlfq" : "wakeup_latency_rr";
+	report(name, nthreads, "p50", g_latency[LATENCY_SAMPLES / 2] / 1000, "us");
+	report(name, nthreads, "p99", g_latency[LATENCY_SAMPLES * 99 / 100] / 1000, "us");
+}
+
+static void bench_wakeup_latency_rr(int nthreads)
+{
+	bench_wakeup_latency(nthreads, UTHREAD_SCHED_RR);
+}
+
+static void bench_wakeup_latency_mlfq(int nthreads)
+{
+	bench_wakeup_latency(nthreads, UTHREAD_SCHED_MLFQ);
+}
+
+/*
+ * Sleep accuracy. A thread sleeps SLEEP_QUANTA quanta of a wall-clock quantum at a time beside nthreads-2 CPU-bound
+ * threads; overshoot is how much longer than SLEEP_QUANTA quanta each sleep took until the thread ran again.
+ */
+#define SLEEP_QUANTA 4
+
+static void sleep_thread(void)
+{
+	for (int i = 0; i < LATENCY_SAMPLES; i++)
+	{
+		double start = now_ns();
+		uthread_sleep(SLEEP_QUANTA);
+		g_latency[i] = now_ns() - start - SLEEP_QUANTA * LATENCY_QUANTUM_USECS * 1000.0;
+	}
+	g_latency_done = 1;
+	uthread_block(uthread_get_tid());
+}
+
+static void bench_sleep_accuracy(int nthreads)
+{
+	uthread_init_attr_t attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.clock = UTHREAD_CLOCK_REAL;
+	uthread_init_ex(LATENCY_QUANTUM_USECS, &attr);
+	for (int i = 2; i < nthreads; i++)
+	{
+		uthread_spawn(idle_thread);
+	}
+	uthread_spawn(sleep_thread);
+	while (!g_latency_done)
+	{
+	}
+
+	qsort(g_latency, LATENCY_SAMPLES, sizeof(double), compare_double);
+	report("sleep_accuracy", nthreads, "overshoot_p50", g_latency[LATENCY_SAMPLES / 2] / 1000, "us");
+	report("sleep_accuracy", nthreads, "overshoot_p99", g_latency[LATENCY_SAMPLES * 99 / 100] / 1000, "us");
+}
+
+/*
+ * Scheduling policies side by side. Picking overhead is the signal-driven switch ring above run under each policy.
+ * Fairness runs CPU-bound threads with weights 1:2:3:4 for FAIR_QUANTA quanta and compares the quanta each one got
+ * with its weight: the Jain index of quanta/weight is 1.0 for a perfectly proportional split, and max_min_ratio is
+ * the share of the heaviest thread over the lightest (4.0 ideally). Round robin and MLFQ ignore weights.
+ */
+#define FAIR_QUANTUM_USECS 1000
+#define FAIR_QUANTA 2000
+#define FAIR_THREADS 4
+
+static uthread_sched_t g_sched;
+
+static const char* sched_name(uthread_sched_t sched)
+{
+	switch (sched)
+	{
+	case UTHREAD_SCHED_MLFQ:
+		return "mlfq";
+	case UTHREAD_SCHED_STRIDE:
+		return "stride";
+	case UTHREAD_SCHED_CFS:
+		return "cfs";
+	default:
+		return "rr";
+	}
+}
+
+static void bench_policy_switch(int nthreads)
+{
+	const int iters = 100000;
+	uthread_init_attr_t attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.sched = g_sched;
+	uthread_init_ex(BENCH_QUANTUM_USECS, &attr);
+	uthread_set_thread_limit(nthreads);
+	for (int i = 1; i < nthreads; i++)
+	{
+		uthread_spawn(signal_switch_thread);
+	}
+
+	int q0 = uthread_get_total_quantums();
+	double start = now_ns();
+	for (int i = 0; i < iters / nthreads; i++)
+	{
+		raise(SIGVTALRM);
+	}
+	double elapsed = now_ns() - start;
+	g_switch_done = 1;
+	int switches = uthread_get_total_quantums() - q0;
+
+	char name[32];
+	snprintf(name, sizeof(name), "pick_%s", sched_name(g_sched));
+	report(name, nthreads, "ns/switch", elapsed / switches, "ns");
+}
+
+static void bench_policy_fairness(int nthreads)
+{
+	uthread_init_attr_t attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.sched = g_sched;
+	uthread_init_ex(FAIR_QUANTUM_USECS, &attr);
+	int tids[FAIR_THREADS];
+	uthread_attr_t thread_attr;
+	memset(&thread_attr, 0, sizeof(thread_attr));
+	for (int i = 0; i < FAIR_THREADS; i++)
+	{
+		thread_attr.weight = (i + 1) * UTHREAD_WEIGHT_DEFAULT;
+		tids[i] = uthread_spawn_ex(idle_thread, &thread_attr);
+	}
+	// The main thread only watches the clock; keep its share small
+	uthread_set_weight(0, 1);
+	while (uthread_get_total_quantums() < FAIR_QUANTA)
+	{
+	}
+
+	double sum = 0, sum_sq = 0, lo = 0, hi = 0;
+	for (int i = 0; i < FAIR_THREADS; i++)
+	{
+		double share = (double)uthread_get_quantums(tids[i]) / (i + 1);
+		sum += share;
+		sum_sq += share * share;
+	}
+	lo = uthread_get_quantums(tids[0]);
+	hi = uthread_get_quantums(tids[FAIR_THREADS - 1]);
+
+	char name[32];
+	snprintf(name, sizeof(name), "fair_%s", sched_name(g_sched));
+	report(name, FAIR_THREADS, "jain_index", sum * sum / (FAIR_THREADS * sum_sq), "");
+	report(name, FAIR_THREADS, "max_min_ratio", lo > 0 ? hi / lo : 0, "");
+}
+
+/*
+ * Heap use of the scheduler. malloc, calloc and realloc are interposed below (operator new goes through malloc) and
+ * count the calls made while g_count_allocs is set. ALLOC_TICKS raised timer signals then drive scheduler_handler
+ * through the policy's pick, preemption of spinning threads, semaphore handoffs, sleeps and traced switches. The
+ * handler must stay async-signal-safe, so a single allocation fails the case.
+ */
+#define ALLOC_TICKS 1000000
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t n, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+
+static volatile int g_count_allocs;
+static unsigned long g_allocs;
+
+extern "C" void* malloc(size_t size)
+{
+	if (g_count_allocs)
+	{
+		g_allocs++;
+	}
+	return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t n, size_t size)
+{
+	if (g_count_allocs)
+	{
+		g_allocs++;
+	}
+	return __libc_calloc(n, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size)
+{
+	if (g_count_allocs)
+	{
+		g_allocs++;
+	}
+	return __libc_realloc(ptr, size);
+}
+
+static uthread_sem_t g_alloc_sems[2];
+
+static void alloc_ping_thread(void)
+{
+	while (1)
+	{
+		uthread_sem_post(&g_alloc_sems[1]);
+		uthread_sem_wait(&g_alloc_sems[0]);
+		raise(SIGVTALRM);
+	}
+}
+
+static void alloc_pong_thread(void)
+{
+	while (1)
+	{
+		uthread_sem_wait(&g_alloc_sems[1]);
+		raise(SIGVTALRM);
+		uthread_sem_post(&g_alloc_sems[0]);
+	}
+}
+
+static void alloc_sleep_thread(void)
+{
+	while (1)
+	{
+		uthread_sleep(1);
+	}
+}
+
+static void alloc_spin_thread(void)
+{
+	while (1)
+	{
+		raise(SIGVTALRM);
+	}
+}
+
+static void bench_alloc_ticks(int nthreads)
+{
+	uthread_init_attr_t attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.sched = g_sched;
+	uthread_init_ex(BENCH_QUANTUM_USECS, &attr);
+	uthread_sem_init(&g_alloc_sems[0], 0);
+	uthread_sem_init(&g_alloc_sems[1], 0);
+	uthread_trace_start(4096);
+	uthread_spawn(alloc_ping_thread);
+	uthread_spawn(alloc_pong_thread);
+	uthread_spawn(alloc_sleep_thread);
+	for (int i = 4; i < nthreads; i++)
+	{
+		uthread_spawn(alloc_spin_thread);
+	}
+
+	int q0 = uthread_get_total_quantums();
+	g_count_allocs = 1;
+	while (uthread_get_total_quantums() - q0 < ALLOC_TICKS)
+	{
+		raise(SIGVTALRM);
+	}
+	g_count_allocs = 0;
+
+	char name[32];
+	snprintf(name, sizeof(name), "alloc_ticks_%s", sched_name(g_sched));
+	report(name, nthreads, "allocations", g_allocs, "");
+	if (g_allocs != 0)
+	{
+		fprintf(stderr, "%s: %lu heap allocations in %d ticks\n", name, g_allocs, ALLOC_TICKS);
+		exit(1);
+	}
+}
+
+/*
+ * Periodic heartbeat threads among CPU-bound ones. Each heartbeat does a short job once per period and counts the
+ * periods in which it got it done. As EDF threads they wait with uthread_wait_next_period and should miss nothing;
+ * as best-effort threads under round robin they sleep to the next period boundary and wait behind every hog.
+ */
+#define HEARTBEAT_QUANTUM_USECS 1000
+#define HEARTBEAT_QUANTA 1000
+
+struct heartbeat
+{
+	int period;
+	int budget;
+	int start;
+	int last_period;
+	int done_periods;
+};
+
+static int g_edf;
+static struct heartbeat g_heartbeats[2] = {{10, 1, 0, 0, 0}, {4, 2, 0, 0, 0}};
+
+static void heartbeat_run(struct heartbeat* hb)
+{
+	if (g_edf)
+	{
+		uthread_set_deadline(uthread_get_tid(), hb->period, hb->budget);
+	}
+	hb->start = uthread_get_total_quantums();
+	hb->last_period = -1;
+	while (1)
+	{
+		double job_end = now_ns() + 200000;
+		while (now_ns() < job_end)
+		{
+		}
+		int elapsed = uthread_get_total_quantums() - hb->start;
+		if (elapsed / hb->period != hb->last_period)
+		{
+			hb->last_period = elapsed / hb->period;
+			hb->done_periods++;
+		}
+		if (g_edf)
+		{
+			uthread_wait_next_period();
+		}
+		else
+		{
+			int left = hb->period - elapsed % hb->period;
+			if (left > 1)
+			{
+				uthread_sleep(left - 1);
+			}
+		}
+	}
+}
+
+static void heartbeat_fast(void)
+{
+	heartbeat_run(&g_heartbeats[1]);
+}
+
+static void heartbeat_slow(void)
+{
+	heartbeat_run(&g_heartbeats[0]);
+}
+
+static void bench_heartbeat(int nthreads)
+{
+	uthread_init_attr_t attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.clock = UTHREAD_CLOCK_REAL;
+	uthread_init_ex(HEARTBEAT_QUANTUM_USECS, &attr);
+	for (int i = 3; i < nthreads; i++)
+	{
+		uthread_spawn(idle_thread);
+	}
+	int tids[2];
+	tids[0] = uthread_spawn(heartbeat_slow);
+	tids[1] = uthread_spawn(heartbeat_fast);
+	while (uthread_get_total_quantums() < HEARTBEAT_QUANTA)
+	{
+	}
+
+	for (int i = 0; i < 2; i++)
+	{
+		struct heartbeat* hb = &g_heartbeats[i];
+		int periods = (uthread_get_total_quantums() - hb->start) / hb->period;
+		int done = hb->done_periods - (hb->last_period >= periods ? 1 : 0);
+		char name[32];
+		snprintf(name, sizeof(name), "heartbeat_%s_p%d", g_edf ? "edf" : "rr", hb->period);
+		report(name, nthreads, "missed_periods", periods - done, "");
+		if (g_edf)
+		{
+			report(name, nthreads, "deadline_misses", uthread_get_deadline_misses(tids[i]), "");
+		}
+	}
+}
+
+/*
+ * Tick modes. A CPU-bound thread alone, then CPU-bound threads beside one that sleeps a quantum at a time, under a
+ * periodic tick, a tickless timer and a tickless timer with an adaptive quantum. The spin rate is the work done per
+ * second of wall-clock time, so the cost of the ticks shows up as a lower rate; quanta per millisecond should read
+ * the same in every mode.
+ */
+#define TICK_QUANTUM_USECS 100
+#define TICK_RUN_NS 300e6
+#define TICK_MAX_THREADS 16
+
+static int g_tick_mode;
+static const char* const g_tick_mode_names[] = {"periodic", "tickless", "adaptive"};
+static volatile unsigned long g_spins[TICK_MAX_THREADS];
+
+static void tick_init()
+{
+	uthread_init_attr_t attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.clock = UTHREAD_CLOCK_REAL;
+	attr.tickless = g_tick_mode >= 1;
+	attr.adaptive_quantum = g_tick_mode == 2 ? 16 : 0;
+	uthread_init_ex(TICK_QUANTUM_USECS, &attr);
+}
+
+static void spin_thread(void)
+{
+	int tid = uthread_get_tid();
+	while (1)
+	{
+		g_spins[tid]++;
+	}
+}
+
+static void bench_tick_alone(int nthreads)
+{
+	tick_init();
+	int quanta = uthread_get_total_quantums();
+	double start = now_ns();
+	while (now_ns() - start < TICK_RUN_NS)
+	{
+		g_spins[0]++;
+	}
+	double elapsed = now_ns() - start;
+	quanta = uthread_get_total_quantums() - quanta;
+
+	char name[32];
+	snprintf(name, sizeof(name), "tick_alone_%s", g_tick_mode_names[g_tick_mode]);
+	report(name, nthreads, "spin_rate", g_spins[0] / elapsed * 1e3, "M/s");
+	report(name, nthreads, "quanta_per_ms", quanta / (elapsed / 1e6), "");
+}
+
+static void bench_tick_mixed(int nthreads)
+{
+	tick_init();
+	for (int i = 2; i < nthreads; i++)
+	{
+		uthread_spawn(spin_thread);
+	}
+	uthread_spawn(handler_thread);
+	int quanta = uthread_get_total_quantums();
+	double start = now_ns();
+	while (!g_latency_done)
+	{
+		g_spins[0]++;
+	}
+	double elapsed = now_ns() - start;
+	quanta = uthread_get_total_quantums() - quanta;
+
+	double spins = 0;
+	for (int i = 0; i < TICK_MAX_THREADS; i++)
+	{
+		spins += g_spins[i];
+	}
+	qsort(g_latency, LATENCY_SAMPLES, sizeof(double), compare_double);
+	char name[32];
+	snprintf(name, sizeof(name), "tick_mixed_%s", g_tick_mode_names[g_tick_mode]);
+	report(name, nthreads, "spin_rate", spins / elapsed * 1e3, "M/s");
+	report(name, nthreads, "quanta_per_ms", quanta / (elapsed / 1e6), "");
+	report(name, nthreads, "wakeup_p99", g_latency[LATENCY_SAMPLES * 99 / 100] / 1000, "us");
+}
+
+static int g_failed;   // Some case's child did not exit cleanly
+
+static void run_forked(void (*fn)(int), int arg)
+{
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0)
+	{
+		fn(arg);
+		_exit(0);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		fprintf(stderr, "benchmark child %d failed (status %d)\n", (int)pid, status);
+		g_failed = 1;
+	}
+}
+
+static int g_ncases;
+static char** g_cases;
+
+// Whether the case called name was asked for on the command line
+static bool selected(const char* name)
+{
+	if (g_ncases == 0)
+	{
+		return true;
+	}
+	for (int i = 0; i < g_ncases; i++)
+	{
+		if (strncmp(name, g_cases[i], strlen(g_cases[i])) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+int main(int argc, char** argv)
+{
+	int i = 1;
+	for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++)
+	{
+		if (strcmp(argv[i], "--format=text") == 0)
+		{
+			g_format = FORMAT_TEXT;
+		}
+		else if (strcmp(argv[i], "--format=csv") == 0)
+		{
+			g_format = FORMAT_CSV;
+		}
+		else if (strcmp(argv[i], "--format=json") == 0)
+		{
+			g_format = FORMAT_JSON;
+		}
+		else
+		{
+			fprintf(stderr, "usage: %s [--format=text|csv|json] [case...]\n", argv[0]);
+			return 2;
+		}
+	}
+	g_ncases = argc - i;
+	g_cases = argv + i;
+	if (g_format == FORMAT_CSV)
+	{
+		printf("bench,threads,metric,value,unit\n");
+		fflush(stdout);
+	}
+
+	// Scheduler overhead against thread count, from a handful to well past MAX_THREAD_NUM
+	const int counts[] = {2, 10, 50, MAX_THREAD_NUM, 1000, 10000};
+	if (selected("block_resume"))
+	{
+		for (int n : counts)
+		{
+			run_forked(bench_block_resume, n);
+		}
+	}
+	if (selected("spawn_terminate"))
+	{
+		for (int n : counts)
+		{
+			run_forked(bench_spawn_terminate, n);
+		}
+	}
+	if (selected("switch_signal"))
+	{
+		for (int n : counts)
+		{
+			run_forked(bench_switch_signal, n);
+		}
+	}
+	if (selected("switch_block_resume"))
+	{
+		run_forked(bench_switch_block_resume, 3);
+	}
+	if (selected("switch_preempt"))
+	{
+		run_forked(bench_switch_preempt, 2);
+	}
+	if (selected("chan_pingpong"))
+	{
+		run_forked(bench_chan_pingpong, 2);
+		g_trace = 1;
+		run_forked(bench_chan_pingpong, 2);
+		g_trace = 0;
+	}
+	if (selected("chan_fanin"))
+	{
+		run_forked(bench_chan_fanin, 2);
+		run_forked(bench_chan_fanin, 10);
+		run_forked(bench_chan_fanin, MAX_THREAD_NUM);
+	}
+	if (selected("io_pingpong"))
+	{
+		for (g_io_pipes = 0; g_io_pipes < 2; g_io_pipes++)
+		{
+			run_forked(bench_io_pingpong, 2);
+			run_forked(bench_io_pingpong, 10);
+			run_forked(bench_io_pingpong, MAX_THREAD_NUM);
+		}
+	}
+	if (selected("io_fanin"))
+	{
+		run_forked(bench_io_fanin, 21);
+		run_forked(bench_io_fanin, MAX_THREAD_NUM);
+	}
+	if (selected("yield_pingpong") || selected("yield_to_pingpong"))
+	{
+		const int yield_counts[] = {2, 10, 100};
+		for (g_yield_directed = 0; g_yield_directed < 2; g_yield_directed++)
+		{
+			if (!selected(g_yield_directed ? "yield_to_pingpong" : "yield_pingpong"))
+			{
+				continue;
+			}
+			for (int n : yield_counts)
+			{
+				run_forked(bench_yield_pingpong, n);
+			}
+		}
+	}
+	if (selected("tasks"))
+	{
+		run_forked(bench_pool_tasks, 2);
+		run_forked(bench_pool_tasks, 5);
+		run_forked(bench_spawn_tasks, TASK_BATCH + 1);
+	}
+	if (selected("mn_cpu") || selected("mn_pingpong"))
+	{
+		// Worker counts up to the number of CPUs, and at least 2 so that M:N mode itself is covered
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		for (g_mn_workers = 1; g_mn_workers <= (ncpu > 2 ? ncpu : 2) && g_mn_workers <= 16; g_mn_workers *= 2)
+		{
+			if (selected("mn_cpu"))
+			{
+				run_forked(bench_mn_cpu, 9);
+			}
+			if (selected("mn_pingpong"))
+			{
+				run_forked(bench_mn_pingpong, 9);
+			}
+		}
+	}
+	if (selected("foreign_wakeup"))
+	{
+		for (g_mn_workers = 1; g_mn_workers <= 2; g_mn_workers++)
+		{
+			run_forked(bench_foreign_wakeup, 2);
+		}
+	}
+	if (selected("wakeup_latency"))
+	{
+		run_forked(bench_wakeup_latency_rr, 10);
+		run_forked(bench_wakeup_latency_mlfq, 10);
+	}
+	if (selected("sleep_accuracy"))
+	{
+		run_forked(bench_sleep_accuracy, 2);
+		run_forked(bench_sleep_accuracy, 10);
+	}
+	if (selected("heartbeat"))
+	{
+		g_edf = 0;
+		run_forked(bench_heartbeat, 16);
+		g_edf = 1;
+		run_forked(bench_heartbeat, 16);
+	}
+	if (selected("tick"))
+	{
+		for (g_tick_mode = 0; g_tick_mode < 3; g_tick_mode++)
+		{
+			run_forked(bench_tick_alone, 1);
+			run_forked(bench_tick_mixed, 5);
+		}
+	}
+	const uthread_sched_t policies[] = {UTHREAD_SCHED_RR, UTHREAD_SCHED_MLFQ, UTHREAD_SCHED_STRIDE, UTHREAD_SCHED_CFS};
+	for (uthread_sched_t sched : policies)
+	{
+		g_sched = sched;
+		if (selected("pick"))
+		{
+			run_forked(bench_policy_switch, 10);
+			run_forked(bench_policy_switch, 1000);
+		}
+		if (selected("fair"))
+		{
+			run_forked(bench_policy_fairness, FAIR_THREADS);
+		}
+		if (selected("alloc_ticks"))
+		{
+			run_forked(bench_alloc_ticks, 6);
+		}
+	}
+	if (selected("scale"))
+	{
+		const int scale_counts[] = {100, 1000, 10000, 100000};
+		for (int n : scale_counts)
+		{
+			run_forked(bench_scale, n);
+		}
+	}
+	return g_failed;
+}
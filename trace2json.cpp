@@ -0,0 +1,137 @@
+/*
+ * Converts a uthreads trace dump (uthread_trace_dump) into Chrome trace JSON, which chrome://tracing and Perfetto
+ * (ui.perfetto.dev) open.
+ *
+ * usage: trace2json [dump] > trace.json     reads the dump from stdin when no file is given
+ *
+ * Every stretch a thread spends on the CPU becomes a "run" slice on that thread's track, with the reason it ended.
+ * The other events become instant events on the track of the thread they concern; "by" names the thread that was
+ * running when they happened.
+ */
+#include "uthreads.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <set>
+
+static const char* type_name(int type)
+{
+	switch (type)
+	{
+	case UTHREAD_TRACE_SPAWN:
+		return "spawn";
+	case UTHREAD_TRACE_WAKE:
+		return "wake";
+	case UTHREAD_TRACE_BLOCK:
+		return "block";
+	case UTHREAD_TRACE_RESUME:
+		return "resume";
+	case UTHREAD_TRACE_TERMINATE:
+		return "terminate";
+	}
+	return "unknown";
+}
+
+static const char* reason_name(int reason)
+{
+	switch (reason)
+	{
+	case UTHREAD_TRACE_PREEMPT:
+		return "preempt";
+	case UTHREAD_TRACE_BLOCKED:
+		return "block";
+	case UTHREAD_TRACE_SLEEP:
+		return "sleep";
+	case UTHREAD_TRACE_WAIT:
+		return "wait";
+	case UTHREAD_TRACE_EXIT:
+		return "terminate";
+	case UTHREAD_TRACE_YIELD:
+		return "yield";
+	}
+	return "unknown";
+}
+
+static bool g_first = true;
+
+static void begin_event()
+{
+	printf(g_first ? "\n" : ",\n");
+	g_first = false;
+}
+
+int main(int argc, char** argv)
+{
+	FILE* in = stdin;
+	if (argc > 1)
+	{
+		in = fopen(argv[1], "rb");
+		if (in == NULL)
+		{
+			perror(argv[1]);
+			return 1;
+		}
+	}
+
+	uthread_trace_header_t header;
+	if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, UTHREAD_TRACE_MAGIC, 8) != 0 ||
+	    header.version != UTHREAD_TRACE_VERSION || header.event_size != sizeof(uthread_trace_event_t))
+	{
+		fprintf(stderr, "trace2json: not a uthreads trace dump\n");
+		return 1;
+	}
+
+	printf("{\"traceEvents\":[");
+	std::map<int, unsigned long long> run_start;   // Threads on the CPU, by the time they were switched in
+	std::set<int> tids;
+	int running = -1;
+	unsigned long long last_ns = 0;
+	uthread_trace_event_t ev;
+	while (fread(&ev, sizeof(ev), 1, in) == 1)
+	{
+		tids.insert(ev.tid);
+		last_ns = ev.ns;
+		if (ev.type == UTHREAD_TRACE_SWITCH_IN)
+		{
+			run_start[ev.tid] = ev.ns;
+			running = ev.tid;
+		}
+		else if (ev.type == UTHREAD_TRACE_SWITCH_OUT)
+		{
+			// A dump that starts mid-run has no switch-in for the first slice; it is left out
+			std::map<int, unsigned long long>::iterator it = run_start.find(ev.tid);
+			if (it != run_start.end())
+			{
+				begin_event();
+				printf("{\"name\":\"run\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+				       "\"args\":{\"out\":\"%s\"}}",
+				       ev.tid, it->second / 1000.0, (ev.ns - it->second) / 1000.0, reason_name(ev.reason));
+				run_start.erase(it);
+			}
+			running = -1;
+		}
+		else
+		{
+			begin_event();
+			printf("{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"by\":%d}}",
+			       type_name(ev.type), ev.tid, ev.ns / 1000.0, running);
+		}
+	}
+
+	// Close the slices of threads still running when the dump was taken
+	for (std::map<int, unsigned long long>::iterator it = run_start.begin(); it != run_start.end(); ++it)
+	{
+		begin_event();
+		printf("{\"name\":\"run\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{}}",
+		       it->first, it->second / 1000.0, (last_ns - it->second) / 1000.0);
+	}
+	for (std::set<int>::iterator it = tids.begin(); it != tids.end(); ++it)
+	{
+		begin_event();
+		printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"uthread %d\"}}",
+		       *it, *it);
+	}
+	printf("\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":%llu}}\n", header.dropped);
+	return 0;
+}
@@ -1,707 +1,4962 @@
 #include "uthreads.h"
-#include <iostream>
-#include <setjmp.h>
-#include <unordered_map>
-#include <unordered_set>
 #include <signal.h>
 #include <sys/time.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <cstdlib> // For exit()
-#include <queue>
 #include <memory> // For smart pointers
 #include <cstring> // For memcpy
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <ucontext.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <limits.h>
 
-#ifdef __x86_64__
+/*
+ * Context switching.
+ *
+ * uthread_switch_context(save_sp, load_sp) pushes the callee-saved registers and the floating-point control state
+ * onto the current stack, stores the stack pointer in *save_sp, then loads load_sp and pops the same frame off the
+ * other thread's stack. Caller-saved registers need no saving because the switch is an ordinary call, and the
+ * signal mask is left alone: the scheduler keeps it consistent itself, so a switch costs no system calls.
+ *
+ * A new thread starts from a hand-built frame whose return address is uthread_context_trampoline, which calls
+ * start(tcb) on the fresh stack (see init_context).
+ */
+extern "C" void uthread_switch_context(void** save_sp, void* load_sp);
+extern "C" void uthread_context_trampoline();
+
+#if defined(__x86_64__)
 /* code for 64 bit Intel arch */
 
-typedef unsigned long address_t;
-#define JB_SP 6
-#define JB_PC 7
+asm(".text\n"
+    ".p2align 4\n"
+    ".type uthread_switch_context, @function\n"
+    "uthread_switch_context:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size uthread_switch_context, .-uthread_switch_context\n"
+    "\n"
+    ".p2align 4\n"
+    ".type uthread_context_trampoline, @function\n"
+    "uthread_context_trampoline:\n"
+    "    movq %r12, %rdi\n"
+    "    callq *%r13\n"
+    "    ud2\n"
+    ".size uthread_context_trampoline, .-uthread_context_trampoline\n");
 
-/* A translation is required when using an address of a variable.
-   Use this as a black box in your code. */
-address_t translate_address(address_t addr)
-{
-    address_t ret;
-    asm volatile("xor    %%fs:0x30,%0\n"
-                 "rol    $0x11,%0\n"
-                 : "=g"(ret)
-                 : "0"(addr));
-    return ret;
-}
+#elif defined(__aarch64__)
+/* code for 64 bit ARM arch */
 
-#else
-/* code for 32 bit Intel arch */
+asm(".text\n"
+    ".p2align 4\n"
+    ".type uthread_switch_context, %function\n"
+    "uthread_switch_context:\n"
+    "    sub sp, sp, #176\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mrs x9, fpcr\n"
+    "    str x9, [sp, #160]\n"
+    "    mov x9, sp\n"
+    "    str x9, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldr x9, [sp, #160]\n"
+    "    msr fpcr, x9\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #176\n"
+    "    ret\n"
+    ".size uthread_switch_context, .-uthread_switch_context\n"
+    "\n"
+    ".p2align 4\n"
+    ".type uthread_context_trampoline, %function\n"
+    "uthread_context_trampoline:\n"
+    "    mov x0, x19\n"
+    "    blr x20\n"
+    "    brk #0\n"
+    ".size uthread_context_trampoline, .-uthread_context_trampoline\n");
 
-typedef unsigned int address_t;
-#define JB_SP 4
-#define JB_PC 5
+#else
+#error "uthreads: context switching is only implemented for x86-64 and AArch64"
+#endif
 
-/* A translation is required when using an address of a variable.
-   Use this as a black box in your code. */
-address_t translate_address(address_t addr)
+// One line of error output, used like a stream: ErrorLine() << "thread library error: ..." << tid << "\n". The line
+// is built in a fixed buffer and goes out with a single write(2) when the temporary is destroyed, so reporting an
+// error neither allocates nor touches stdio or iostreams, and is safe from the timer handler.
+struct ErrorLine
 {
-  address_t ret;
-  asm volatile("xor    %%gs:0x18,%0\n"
-               "rol    $0x9,%0\n"
-      : "=g"(ret)
-      : "0"(addr));
-  return ret;
-}
+    char buf[256];
+    size_t len = 0;
 
-#endif
+    ~ErrorLine()
+    {
+        ssize_t ignored = write(STDERR_FILENO, buf, len);
+        (void)ignored;
+    }
+
+    ErrorLine& operator<<(const char* s)
+    {
+        while (*s != '\0' && len < sizeof(buf))
+        {
+            buf[len++] = *s++;
+        }
+        return *this;
+    }
+
+    ErrorLine& operator<<(unsigned long long v)
+    {
+        char digits[20];
+        int n = 0;
+        do
+        {
+            digits[n++] = (char)('0' + v % 10);
+            v /= 10;
+        } while (v > 0);
+        while (n > 0 && len < sizeof(buf))
+        {
+            buf[len++] = digits[--n];
+        }
+        return *this;
+    }
 
-// Add near the top with other globals
-static char* g_stack_memory = nullptr;     // Pre-allocated memory for all stacks
-static bool* g_stack_in_use = nullptr;     // Tracks which stack slots are in use
+    ErrorLine& operator<<(long long v)
+    {
+        if (v < 0)
+        {
+            *this << "-";
+        }
+        return *this << (v < 0 ? 0ULL - (unsigned long long)v : (unsigned long long)v);
+    }
+
+    ErrorLine& operator<<(int v) { return *this << (long long)v; }
+    ErrorLine& operator<<(long v) { return *this << (long long)v; }
+    ErrorLine& operator<<(unsigned long v) { return *this << (unsigned long long)v; }
+};
 
 // Scheduler states (must match the conceptual RUNNING/READY/BLOCKED)
 enum State
 {
     RUNNING,
     READY,
-    BLOCKED
+    BLOCKED,
+    ZOMBIE     // Terminated but joinable: holds its tid and exit value until uthread_join
+};
+
+// Reasons a thread can be BLOCKED; it becomes READY again once all of them are cleared
+enum BlockReason
+{
+    BLOCK_EXPLICIT = 1 << 0,   // uthread_block, cleared by uthread_resume
+    BLOCK_SLEEP = 1 << 1,      // uthread_sleep, cleared when wake_time is reached
+    BLOCK_WAIT = 1 << 2,       // parked on a synchronization object, cleared when it is handed over
+    BLOCK_IO = 1 << 3,         // parked on a file descriptor, cleared when epoll reports it ready
+    BLOCK_STOP = 1 << 4        // M:N: switched out for another worker's uthread_block or uthread_terminate
+};
+
+// Scheduler statistics of one thread. Times are in stats_stamp() cycles until they are reported.
+struct ThreadStats
+{
+    uint64_t cpu;
+    uint64_t ready;
+    uint64_t voluntary;
+    uint64_t involuntary;
+    uint64_t sleeps;
+    uint64_t overshoot_ns;
+
+    void add(const ThreadStats& o)
+    {
+        cpu += o.cpu;
+        ready += o.ready;
+        voluntary += o.voluntary;
+        involuntary += o.involuntary;
+        sleeps += o.sleeps;
+        overshoot_ns += o.overshoot_ns;
+    }
 };
 
-// Thread Control Block (TCB) structure
-struct TCB
+// Thread Control Block (TCB) structure. TCBs live in a fixed table indexed by tid and are recycled in place,
+// so each one gets its own cache line(s) to keep neighbouring threads from sharing.
+struct alignas(64) TCB
 {
     int id;
     int quantums;
-    char* stack;           // Pointer to this thread's stack in the global array
-    int stack_index;       // Index of this thread's stack in the array
+    char* stack;           // Lowest usable byte of the thread's stack, just above the guard page
+    size_t stack_size;     // Usable stack bytes
+    char* slot;            // Stack slot (guard page first), kept across reset() for reuse by the next thread
+    size_t slot_len;
+    bool guarded;          // The slot's guard page is PROT_NONE; otherwise it holds a canary
     State state;
-    jmp_buf env;
-    int wake_time;
-    bool explicitly_blocked;
+    void* sp;              // Saved stack pointer while the thread is switched out
+    thread_entry_point entry;
+    thread_arg_entry_point arg_entry;   // Entry point taking arg, used when entry is null
+    void* arg;
+    int block_reasons;     // BlockReason bits, non-zero only while state == BLOCKED
+    int wake_time;         // Quantum at which a sleeping thread is due, -1 if not sleeping
+    int sleep_index;       // Position in the sleep heap, -1 if not sleeping
+    TCB* rq_prev;          // Links in a ready-queue level, or in the wait queue the thread is parked on
+    TCB* rq_next;
+    uthread_waitq_t* waitq;        // Wait queue the thread is parked on, if any
+    uthread_mutex_t* wait_mutex;   // Mutex to reacquire when woken from a condition variable
+    void* wait_msg;                // Channel message being sent, or handed to a parked receiver or joiner
+    int wait_status;               // Result of a channel operation completed by another thread
+    int priority;                  // Set by uthread_set_priority
+    int level;                     // Ready-queue level; equals priority except under MLFQ
+    unsigned boost_epoch;          // MLFQ boost the level was last reset for
+    int weight;                    // Set by uthread_set_weight
+    int64_t vkey;                  // STRIDE pass or CFS virtual runtime; orders the fair-share tree
+    long long run_start;           // CFS: when the thread was last picked, 0 if never
+    TCB* rb_parent;                // Links in the fair-share tree while READY
+    TCB* rb_left;
+    TCB* rb_right;
+    bool rb_red;
+    int edf_period;                // EDF period in quanta, 0 for a best-effort thread
+    int edf_budget;                // Quanta the thread may run per period
+    int edf_remaining;             // Budget left in the current period
+    int edf_deadline;              // Quantum at which the current period ends
+    bool edf_throttled;            // Out of budget and sleeping until edf_deadline
+    int edf_misses;
+    int slice;                     // Adaptive quantum: quanta the thread may run per turn
+    bool interactive;              // Left the CPU before its last turn ended
+    uint64_t stat_stamp;           // Cycle count when the thread last started RUNNING or became READY
+    uint64_t stat_woken;           // Cycle count when a wakeup made it READY, 0 once it has run since
+    uint64_t stat_sleep_start;     // Cycle count when its current uthread_sleep began, 0 if not sleeping
+    long long stat_sleep_ns;       // Length that sleep asked for
+    ThreadStats stats;
+    bool joinable;
+    void* exit_value;              // Set once the thread is a ZOMBIE
+    uthread_waitq_t join_waiters;  // The thread parked in uthread_join on this one, if any
+    unsigned gen;                  // Bumped by reset(), so a thread can tell whether its TCB was recycled
+    int cpu;                       // M:N: worker the thread last ran on
+    bool stop_requested;           // M:N: another worker waits for the thread to leave its CPU
+    bool queued;                   // M:N: the thread has an entry in a worker deque; kept across reset()
+    std::atomic<bool> foreign_queued;   // On foreign_wakeups; kept across reset(), like foreign_next
+    TCB* foreign_next;
+    bool yielding;                 // Leaving the CPU through uthread_yield or uthread_yield_to
+
+    // Prepare a (possibly recycled) TCB for a new thread with the given tid
+    void reset(int tid)
+    {
+        id = tid;
+        quantums = 0;
+        stack = nullptr;
+        stack_size = 0;
+        sp = nullptr;
+        entry = nullptr;
+        arg_entry = nullptr;
+        arg = nullptr;
+        state = READY;
+        block_reasons = 0;
+        wake_time = -1;
+        sleep_index = -1;
+        rq_prev = rq_next = nullptr;
+        waitq = nullptr;
+        wait_mutex = nullptr;
+        wait_msg = nullptr;
+        wait_status = 0;
+        priority = 0;
+        level = 0;
+        weight = UTHREAD_WEIGHT_DEFAULT;
+        vkey = 0;
+        run_start = 0;
+        edf_period = edf_budget = edf_remaining = edf_deadline = 0;
+        edf_throttled = false;
+        edf_misses = 0;
+        slice = 1;
+        interactive = true;
+        stat_stamp = stat_woken = stat_sleep_start = 0;
+        stat_sleep_ns = 0;
+        stats = ThreadStats();
+        joinable = false;
+        exit_value = nullptr;
+        join_waiters.head = join_waiters.tail = nullptr;
+        gen++;
+        cpu = 0;
+        stop_requested = false;
+        yielding = false;
+    }
+};
+
+// Intrusive FIFO of READY threads, linked through TCB::rq_prev/rq_next.
+// Push, pop and removal of an arbitrary thread are O(1) and never allocate.
+struct RunList
+{
+    TCB* head;
+    TCB* tail;
+
+    RunList() : head(nullptr), tail(nullptr) {}
+    RunList(TCB* h, TCB* t) : head(h), tail(t) {}
+
+    bool empty() const { return head == nullptr; }
+
+    void push_back(TCB* t)
+    {
+        t->rq_next = nullptr;
+        t->rq_prev = tail;
+        if (tail) tail->rq_next = t;
+        else head = t;
+        tail = t;
+    }
+
+    TCB* pop_front()
+    {
+        TCB* t = head;
+        if (t) remove(t);
+        return t;
+    }
+
+    void remove(TCB* t)
+    {
+        if (t->rq_prev) t->rq_prev->rq_next = t->rq_next;
+        else head = t->rq_next;
+        if (t->rq_next) t->rq_next->rq_prev = t->rq_prev;
+        else tail = t->rq_prev;
+        t->rq_prev = t->rq_next = nullptr;
+    }
+};
+
+// READY threads of the priority policies: one RunList per priority level (0 is the highest) and a bitmap of the
+// non-empty levels, so picking the next thread is a find-first-set however many threads are queued. A queued thread's
+// level must not change.
+struct ReadyQueue
+{
+    RunList levels[UTHREAD_PRIO_LEVELS];
+    uint32_t nonempty;
+
+    ReadyQueue() : nonempty(0) {}
+
+    bool empty() const { return nonempty == 0; }
+
+    // Highest level with a READY thread; the queue must not be empty
+    int top_level() const { return __builtin_ctz(nonempty); }
+
+    void push_back(TCB* t)
+    {
+        levels[t->level].push_back(t);
+        nonempty |= 1u << t->level;
+    }
+
+    TCB* pop_front()
+    {
+        if (nonempty == 0) return nullptr;
+        int level = top_level();
+        TCB* t = levels[level].pop_front();
+        if (levels[level].empty()) nonempty &= ~(1u << level);
+        return t;
+    }
+
+    void remove(TCB* t)
+    {
+        levels[t->level].remove(t);
+        if (levels[t->level].empty()) nonempty &= ~(1u << t->level);
+    }
+};
+
+// READY threads of the proportional-share policies: an intrusive red-black tree ordered by TCB::vkey, with the
+// leftmost node cached so that the next thread is found in O(1). Equal keys keep their insertion order.
+struct FairTree
+{
+    TCB* root;
+    TCB* leftmost;
+
+    FairTree() : root(nullptr), leftmost(nullptr) {}
+
+    void insert(TCB* t)
+    {
+        TCB* parent = nullptr;
+        TCB** link = &root;
+        bool is_leftmost = true;
+        while (*link)
+        {
+            parent = *link;
+            if (t->vkey < parent->vkey)
+            {
+                link = &parent->rb_left;
+            }
+            else
+            {
+                link = &parent->rb_right;
+                is_leftmost = false;
+            }
+        }
+        t->rb_parent = parent;
+        t->rb_left = t->rb_right = nullptr;
+        t->rb_red = true;
+        *link = t;
+        if (is_leftmost) leftmost = t;
+        insert_fixup(t);
+    }
+
+    void erase(TCB* z)
+    {
+        if (z == leftmost) leftmost = successor(z);
+        TCB* y = z;
+        bool y_red = y->rb_red;
+        TCB* x;
+        TCB* x_parent;
+        if (z->rb_left == nullptr)
+        {
+            x = z->rb_right;
+            x_parent = z->rb_parent;
+            transplant(z, z->rb_right);
+        }
+        else if (z->rb_right == nullptr)
+        {
+            x = z->rb_left;
+            x_parent = z->rb_parent;
+            transplant(z, z->rb_left);
+        }
+        else
+        {
+            y = z->rb_right;
+            while (y->rb_left) y = y->rb_left;
+            y_red = y->rb_red;
+            x = y->rb_right;
+            if (y->rb_parent == z)
+            {
+                x_parent = y;
+            }
+            else
+            {
+                x_parent = y->rb_parent;
+                transplant(y, y->rb_right);
+                y->rb_right = z->rb_right;
+                y->rb_right->rb_parent = y;
+            }
+            transplant(z, y);
+            y->rb_left = z->rb_left;
+            y->rb_left->rb_parent = y;
+            y->rb_red = z->rb_red;
+        }
+        if (!y_red) erase_fixup(x, x_parent);
+    }
+
+private:
+    static bool is_red(TCB* t) { return t != nullptr && t->rb_red; }
+
+    static TCB* successor(TCB* t)
+    {
+        if (t->rb_right)
+        {
+            t = t->rb_right;
+            while (t->rb_left) t = t->rb_left;
+            return t;
+        }
+        while (t->rb_parent && t == t->rb_parent->rb_right) t = t->rb_parent;
+        return t->rb_parent;
+    }
+
+    // Put v (possibly null) where u hangs in the tree
+    void transplant(TCB* u, TCB* v)
+    {
+        if (u->rb_parent == nullptr) root = v;
+        else if (u == u->rb_parent->rb_left) u->rb_parent->rb_left = v;
+        else u->rb_parent->rb_right = v;
+        if (v) v->rb_parent = u->rb_parent;
+    }
+
+    void rotate_left(TCB* x)
+    {
+        TCB* y = x->rb_right;
+        x->rb_right = y->rb_left;
+        if (y->rb_left) y->rb_left->rb_parent = x;
+        transplant(x, y);
+        y->rb_left = x;
+        x->rb_parent = y;
+    }
+
+    void rotate_right(TCB* x)
+    {
+        TCB* y = x->rb_left;
+        x->rb_left = y->rb_right;
+        if (y->rb_right) y->rb_right->rb_parent = x;
+        transplant(x, y);
+        y->rb_right = x;
+        x->rb_parent = y;
+    }
+
+    void insert_fixup(TCB* t)
+    {
+        while (is_red(t->rb_parent))
+        {
+            TCB* p = t->rb_parent;
+            TCB* g = p->rb_parent;
+            if (p == g->rb_left)
+            {
+                TCB* u = g->rb_right;
+                if (is_red(u))
+                {
+                    p->rb_red = u->rb_red = false;
+                    g->rb_red = true;
+                    t = g;
+                    continue;
+                }
+                if (t == p->rb_right)
+                {
+                    rotate_left(p);
+                    t = p;
+                    p = t->rb_parent;
+                }
+                p->rb_red = false;
+                g->rb_red = true;
+                rotate_right(g);
+            }
+            else
+            {
+                TCB* u = g->rb_left;
+                if (is_red(u))
+                {
+                    p->rb_red = u->rb_red = false;
+                    g->rb_red = true;
+                    t = g;
+                    continue;
+                }
+                if (t == p->rb_left)
+                {
+                    rotate_right(p);
+                    t = p;
+                    p = t->rb_parent;
+                }
+                p->rb_red = false;
+                g->rb_red = true;
+                rotate_left(g);
+            }
+        }
+        root->rb_red = false;
+    }
+
+    void erase_fixup(TCB* x, TCB* parent)
+    {
+        while (x != root && !is_red(x))
+        {
+            if (x == parent->rb_left)
+            {
+                TCB* w = parent->rb_right;
+                if (is_red(w))
+                {
+                    w->rb_red = false;
+                    parent->rb_red = true;
+                    rotate_left(parent);
+                    w = parent->rb_right;
+                }
+                if (!is_red(w->rb_left) && !is_red(w->rb_right))
+                {
+                    w->rb_red = true;
+                    x = parent;
+                    parent = x->rb_parent;
+                    continue;
+                }
+                if (!is_red(w->rb_right))
+                {
+                    w->rb_left->rb_red = false;
+                    w->rb_red = true;
+                    rotate_right(w);
+                    w = parent->rb_right;
+                }
+                w->rb_red = parent->rb_red;
+                parent->rb_red = false;
+                if (w->rb_right) w->rb_right->rb_red = false;
+                rotate_left(parent);
+            }
+            else
+            {
+                TCB* w = parent->rb_left;
+                if (is_red(w))
+                {
+                    w->rb_red = false;
+                    parent->rb_red = true;
+                    rotate_right(parent);
+                    w = parent->rb_left;
+                }
+                if (!is_red(w->rb_left) && !is_red(w->rb_right))
+                {
+                    w->rb_red = true;
+                    x = parent;
+                    parent = x->rb_parent;
+                    continue;
+                }
+                if (!is_red(w->rb_left))
+                {
+                    w->rb_right->rb_red = false;
+                    w->rb_red = true;
+                    rotate_left(w);
+                    w = parent->rb_left;
+                }
+                w->rb_red = parent->rb_red;
+                parent->rb_red = false;
+                if (w->rb_left) w->rb_left->rb_red = false;
+                rotate_right(parent);
+            }
+            x = root;
+        }
+        if (x) x->rb_red = false;
+    }
+};
+
+// Binary min-heap of sleeping threads keyed on wake_time. Each tick only looks at the top, so threads that are
+// blocked or still far from their deadline cost nothing. Every TCB records its slot for O(log n) removal.
+struct SleepHeap
+{
+    std::vector<TCB*> slots;   // Sized to the TCB table, so push never allocates
+    int size;
+
+    SleepHeap() : size(0) {}
+
+    void resize(int capacity) { slots.resize(capacity); }
+
+    bool empty() const { return size == 0; }
+    TCB* top() const { return slots[0]; }
+
+    void push(TCB* t)
+    {
+        place(t, size++);
+        sift_up(t->sleep_index);
+    }
+
+    TCB* pop()
+    {
+        TCB* t = slots[0];
+        remove(t);
+        return t;
+    }
+
+    void remove(TCB* t)
+    {
+        int i = t->sleep_index;
+        TCB* last = slots[--size];
+        t->sleep_index = -1;
+        if (i == size) return;
+        place(last, i);
+        sift_down(i);
+        sift_up(last->sleep_index);
+    }
+
+private:
+    void place(TCB* t, int i)
+    {
+        slots[i] = t;
+        t->sleep_index = i;
+    }
 
-    TCB(int tid)
-        : id(tid), quantums(0), stack(nullptr), stack_index(-1),
-          state(READY), wake_time(-1), explicitly_blocked(false)
+    void sift_up(int i)
     {
+        TCB* t = slots[i];
+        while (i > 0)
+        {
+            int parent = (i - 1) / 2;
+            if (slots[parent]->wake_time <= t->wake_time) break;
+            place(slots[parent], i);
+            i = parent;
+        }
+        place(t, i);
     }
 
-    // No need for a destructor that frees the stack
-    ~TCB() {}
+    void sift_down(int i)
+    {
+        TCB* t = slots[i];
+        for (;;)
+        {
+            int child = 2 * i + 1;
+            if (child >= size) break;
+            if (child + 1 < size && slots[child + 1]->wake_time < slots[child]->wake_time) child++;
+            if (t->wake_time <= slots[child]->wake_time) break;
+            place(slots[child], i);
+            i = child;
+        }
+        place(t, i);
+    }
 };
 
-static std::unordered_map<int, TCB*> threads; // Changed from unique_ptr to raw pointer
-static std::queue<int> ready_queue;
-static std::unordered_set<int> blocked_set;
-static int current_tid;
+// Thread table. TCBs are mapped in chunks of TCB_CHUNK as the tid space in use grows, up to
+// UTHREAD_THREAD_LIMIT_MAX. A chunk is never moved or freed, so TCB pointers stay valid for the life of the process.
+#define TCB_CHUNK 1024
+#define TID_WORDS (UTHREAD_THREAD_LIMIT_MAX / 64)
+
+static TCB* tcb_chunks[UTHREAD_THREAD_LIMIT_MAX / TCB_CHUNK];
+static int tcb_capacity;                   // Number of TCBs mapped so far
+static uint64_t tid_in_use[TID_WORDS];     // Bit tid is set while tid belongs to a live thread
+static int tid_hint;                       // Every word below this one is full
+static int thread_limit = MAX_THREAD_NUM;
+static int num_threads;
+
+static inline TCB* tcb(int tid)
+{
+  return &tcb_chunks[tid / TCB_CHUNK][tid % TCB_CHUNK];
+}
+static SleepHeap sleepers;
+static thread_local int current_tid;   // Per worker in M:N mode; -1 while a worker runs its idle loop
+static thread_local bool runs_uthreads;   // This kernel thread is the one uthread_init ran on, or an M:N worker
+static pthread_t init_thread;
 static int total_quantums;
 static int quantum_usecs;
+static uthread_clock_t timer_clock;
+static timer_t posix_timer;
+
+// Signal the preemption timer raises
+static int timer_signal()
+{
+  return timer_clock == UTHREAD_CLOCK_REAL ? SIGALRM : SIGVTALRM;
+}
+
+// Wall-clock timers keep ticking while the process is idle; CPU-time timers do not
+static bool timer_is_wall_clock()
+{
+  return timer_clock == UTHREAD_CLOCK_REAL || timer_clock == UTHREAD_CLOCK_MONOTONIC;
+}
+
+// Arm the timer to fire after usecs and every quantum after that; 0 stops it
+static void arm_timer(long long usecs)
+{
+  if (timer_clock == UTHREAD_CLOCK_VIRTUAL || timer_clock == UTHREAD_CLOCK_REAL)
+  {
+    struct itimerval timer;
+    timer.it_interval.tv_sec = quantum_usecs / 1000000;
+    timer.it_interval.tv_usec = quantum_usecs % 1000000;
+    timer.it_value.tv_sec = usecs / 1000000;
+    timer.it_value.tv_usec = usecs % 1000000;
+
+    if (setitimer(timer_clock == UTHREAD_CLOCK_VIRTUAL ? ITIMER_VIRTUAL : ITIMER_REAL, &timer, nullptr) < 0)
+    {
+      perror("system error: setitimer");
+      exit(1);
+    }
+  }
+  else
+  {
+    struct itimerspec its;
+    its.it_interval.tv_sec = quantum_usecs / 1000000;
+    its.it_interval.tv_nsec = (quantum_usecs % 1000000) * 1000L;
+    its.it_value.tv_sec = usecs / 1000000;
+    its.it_value.tv_nsec = (usecs % 1000000) * 1000L;
+    if (timer_settime(posix_timer, 0, &its, nullptr) < 0)
+    {
+      perror("system error: timer_settime");
+      exit(1);
+    }
+  }
+}
+
+// Create a POSIX timer on the configured clock that signals the calling kernel thread
+static void create_timer(timer_t* timer)
+{
+  struct sigevent sev;
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_signo = timer_signal();
+#ifdef SIGEV_THREAD_ID
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev._sigev_un._tid = (pid_t)syscall(SYS_gettid);
+#else
+  sev.sigev_notify = SIGEV_SIGNAL;
+#endif
+  clockid_t clock = timer_clock == UTHREAD_CLOCK_MONOTONIC ? CLOCK_MONOTONIC : CLOCK_PROCESS_CPUTIME_ID;
+  if (timer_create(clock, &sev, timer) < 0)
+  {
+    perror("system error: timer_create");
+    exit(1);
+  }
+}
+
+// Current reading of the clock the timer measures, in nanoseconds
+static long long timer_clock_ns()
+{
+  struct timespec ts;
+  if (timer_clock == UTHREAD_CLOCK_VIRTUAL)
+  {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec * 1000000000LL + ru.ru_utime.tv_usec * 1000LL;
+  }
+  clock_gettime(timer_clock == UTHREAD_CLOCK_PROCESS_CPU ? CLOCK_PROCESS_CPUTIME_ID : CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Tickless and adaptive modes. Instead of a tick every quantum, the timer can be armed to fire after several quanta
+// (tick_program > 1) or stopped (0). The quanta that pass in between are credited to the running thread by
+// sync_quanta before anything reads the counts. -1 means a scheduling decision is in progress and the timer is
+// re-armed by tick_plan when it is made.
+static bool tickless;
+static int adaptive_quantum;       // Longest turn in quanta; 0 or 1 disables the adaptive quantum
+static int tick_program = 1;       // Quanta until the armed tick, counting down as they are credited
+static long long tick_start_ns;    // timer_clock_ns() at the start of the first quantum not yet credited
+
+static void sync_quanta(bool expired = false)
+{
+  if (tick_program == 1 || tick_program == -1)
+  {
+    return;
+  }
+  long long quantum_ns = quantum_usecs * 1000LL;
+  long long elapsed = timer_clock_ns() - tick_start_ns;
+  long long k = elapsed / quantum_ns;
+  if (expired)
+  {
+    // The tick being handled counts its own quantum
+    k = (elapsed + quantum_ns / 2) / quantum_ns - 1;
+    if (k < 0) k = 0;
+  }
+  if (tick_program > 1)
+  {
+    if (k > tick_program - 1) k = tick_program - 1;
+    tick_program -= (int)k;
+  }
+  total_quantums += (int)k;
+  tcb(current_tid)->quantums += (int)k;
+  tick_start_ns += k * quantum_ns;
+}
+
+// M:N mode (uthread_init_attr_t.workers > 1). Each worker is a kernel thread that runs uthreads; worker 0 is the
+// thread that called uthread_init_ex. The scheduler state stays shared and sched_lock protects it: a worker takes
+// the lock when it enters a critical section and drops it when it leaves the outermost one. A switch happens inside
+// a critical section, so the lock is handed over with the CPU and released by the thread switched to. No other worker
+// can therefore pick a thread before its context has been saved. What belongs to a worker rather than to the process
+// (the running thread, the preemption flags below, the switch timestamp) is thread-local.
+static int nworkers = 1;
+static std::atomic<bool> sched_locked;
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+static void sched_lock()
+{
+  // Back off to the kernel now and then: the holder may be a preempted worker on the same core
+  for (int spins = 0; sched_locked.exchange(true, std::memory_order_acquire); spins++)
+  {
+    while (sched_locked.load(std::memory_order_relaxed))
+    {
+      if (++spins % 128 == 0) sched_yield();
+      else cpu_relax();
+    }
+  }
+}
+
+static void sched_unlock()
+{
+  sched_locked.store(false, std::memory_order_release);
+}
+
+// Preemption control. Library code runs inside critical sections instead of masking the timer signal:
+// preempt_depth counts the nesting of the running thread, and while it is non-zero the timer handler only sets
+// preempt_pending. The deferred preemption is taken when the outermost section exits. A switch is always made inside
+// a critical section and the depth travels with the thread: schedule() restores the caller's depth when it is
+// switched back in. preempt_resched asks for the same when a thread that outranks the running one becomes READY.
+static thread_local volatile sig_atomic_t preempt_depth;
+static thread_local volatile sig_atomic_t preempt_pending;
+static thread_local volatile sig_atomic_t preempt_resched;
+
+static void schedule(bool expired = false);
+
+static inline void enter_critical()
+{
+  preempt_depth = preempt_depth + 1;
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  if (nworkers > 1 && preempt_depth == 1) sched_lock();
+}
+
+static inline void exit_critical()
+{
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  if (nworkers > 1 && preempt_depth == 1) sched_unlock();
+  preempt_depth = preempt_depth - 1;
+  if (preempt_depth == 0 && (preempt_pending || preempt_resched))
+  {
+    // A tick arrived inside the critical section, or a higher-priority thread woke up; take the preemption now
+    bool expired = preempt_pending;
+    preempt_depth = 1;
+    if (nworkers > 1) sched_lock();
+    preempt_pending = 0;
+    schedule(expired);
+    if (nworkers > 1) sched_unlock();
+    preempt_depth = 0;
+  }
+}
+
+static long long monotonic_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Scheduler statistics. Switches are timed with the CPU's cycle counter, which is read without a system call.
+// Cycles are turned into nanoseconds with a factor calibrated against CLOCK_MONOTONIC at initialization (exact on
+// AArch64, whose counter reports its frequency); reported sums are converted again over the whole time since then.
+static inline uint64_t stats_stamp()
+{
+#if defined(__x86_64__)
+  uint32_t lo, hi;
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+#else
+  uint64_t v;
+  asm volatile("mrs %0, cntvct_el0" : "=r"(v));
+  return v;
+#endif
+}
+
+static uint64_t stats_base;            // stats_stamp() at initialization
+static long long stats_base_ns;        // monotonic_ns() at the same moment
+static uint64_t stats_mult;            // Nanoseconds per cycle, 32.32 fixed point
+static ThreadStats retired_stats;      // Counters of terminated threads
+static uint64_t stats_idle_ns;
+static thread_local uint64_t switch_stamp;   // When the last thread left this CPU; the next one to run times the switch
+static uint64_t switch_hist[UTHREAD_HIST_BUCKETS];
+static uint64_t wakeup_hist[UTHREAD_HIST_BUCKETS];
+
+static void stats_calibrate()
+{
+  stats_base = stats_stamp();
+  stats_base_ns = monotonic_ns();
+#if defined(__aarch64__)
+  uint64_t freq;
+  asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+  stats_mult = (1000000000ULL << 32) / freq;
+#else
+  long long ns;
+  uint64_t cycles;
+  do
+  {
+    ns = monotonic_ns() - stats_base_ns;
+    cycles = stats_stamp() - stats_base;
+  } while (ns < 20000);
+  stats_mult = ((uint64_t)ns << 32) / cycles;
+#endif
+}
+
+static inline uint64_t cycles_ns(uint64_t cycles)
+{
+  return (uint64_t)((unsigned __int128)cycles * stats_mult >> 32);
+}
+
+static inline void hist_add(uint64_t* hist, uint64_t cycles)
+{
+  uint64_t ns = cycles_ns(cycles);
+  int bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+  hist[bucket < UTHREAD_HIST_BUCKETS ? bucket : UTHREAD_HIST_BUCKETS - 1]++;
+}
+
+// Scheduling trace. Events go into a power-of-two ring mapped by uthread_trace_start, stamped in cycles that
+// uthread_trace_dump converts. trace_head counts every event ever recorded, so the ring holds the last
+// trace_mask + 1 of them. Only the running thread records, from a critical section or the timer handler, so no
+// lock is needed.
+static uthread_trace_event_t* trace_ring;
+static size_t trace_mapped;        // Entries mapped; a later, smaller trace reuses the mapping
+static uint64_t trace_mask;
+static uint64_t trace_head;
+static bool trace_on;
+
+static inline void trace(int type, int tid, int reason, uint64_t stamp)
+{
+  if (!trace_on)
+  {
+    return;
+  }
+  uthread_trace_event_t* e = &trace_ring[trace_head++ & trace_mask];
+  e->ns = stamp;
+  e->tid = tid;
+  e->type = (unsigned char)type;
+  e->reason = (unsigned char)reason;
+  e->reserved = 0;
+}
+
+// Why a thread that is leaving the CPU does so
+static int switch_reason(TCB* t)
+{
+  if (t->yielding) return UTHREAD_TRACE_YIELD;
+  if (t->state != BLOCKED || t->edf_throttled) return UTHREAD_TRACE_PREEMPT;
+  if (t->block_reasons & BLOCK_EXPLICIT) return UTHREAD_TRACE_BLOCKED;
+  if (t->block_reasons & BLOCK_SLEEP) return UTHREAD_TRACE_SLEEP;
+  return UTHREAD_TRACE_WAIT;
+}
+
+// A switch into t is complete and t is running
+static void stats_switch_in(TCB* t)
+{
+  uint64_t now = stats_stamp();
+  trace(UTHREAD_TRACE_SWITCH_IN, t->id, 0, now);
+  hist_add(switch_hist, now - switch_stamp);
+  t->stats.ready += now - t->stat_stamp;
+  t->stat_stamp = now;
+  if (t->stat_woken != 0)
+  {
+    hist_add(wakeup_hist, now - t->stat_woken);
+    t->stat_woken = 0;
+  }
+  if (t->stat_sleep_start != 0)
+  {
+    long long slept = (long long)cycles_ns(now - t->stat_sleep_start);
+    t->stats.sleeps++;
+    if (slept > t->stat_sleep_ns)
+    {
+      t->stats.overshoot_ns += slept - t->stat_sleep_ns;
+    }
+    t->stat_sleep_start = 0;
+  }
+}
+
+// t's counters including the stretch it is in now if it is RUNNING or READY
+static ThreadStats stats_of(TCB* t)
+{
+  ThreadStats s = t->stats;
+  if (t->state == RUNNING)
+  {
+    s.cpu += stats_stamp() - t->stat_stamp;
+  }
+  else if (t->state == READY)
+  {
+    s.ready += stats_stamp() - t->stat_stamp;
+  }
+  return s;
+}
+
+// Nanoseconds per cycle as num / den for reporting. The startup calibration is refined over the time since
+// initialization once that is long enough to be the more precise of the two.
+static void stats_ratio(unsigned __int128* num, unsigned __int128* den)
+{
+  *num = stats_mult;
+  *den = 1ULL << 32;
+  long long ns = monotonic_ns() - stats_base_ns;
+  uint64_t cycles = stats_stamp() - stats_base;
+  if (ns > 100000000 && cycles > 0)
+  {
+    *num = (uint64_t)ns;
+    *den = cycles;
+  }
+}
+
+// Convert counters to the public struct
+static void stats_export(const ThreadStats& s, uthread_stats_t* out)
+{
+  unsigned __int128 num, den;
+  stats_ratio(&num, &den);
+  out->cpu_ns = (unsigned long long)(s.cpu * num / den);
+  out->ready_ns = (unsigned long long)(s.ready * num / den);
+  out->voluntary_switches = s.voluntary;
+  out->involuntary_switches = s.involuntary;
+  out->sleeps = s.sleeps;
+  out->sleep_overshoot_ns = s.overshoot_ns;
+}
+
+// Scheduling policies. The core decides when to switch and keeps BLOCKED threads; the policy holds the READY threads
+// and decides which one runs next. All hooks run inside a critical section.
+struct SchedPolicy
+{
+    void (*enqueue)(TCB* t);            // t became READY: spawned, woken, or taken off the CPU while runnable
+    void (*dequeue)(TCB* t);            // Take READY t out without running it
+    TCB* (*pick_next)();                // Remove and return the thread to run next; at least one is READY
+    void (*on_tick)(TCB* cur);          // cur's quantum expired while it was running
+    void (*on_block)(TCB* cur);         // cur is leaving the CPU before its quantum expired
+    bool (*should_preempt)(TCB* cur);   // Whether a READY thread should take the CPU from cur right away
+};
+
+static const SchedPolicy* policy;
+static int nr_ready;               // Number of threads the policy holds
+static int explicit_blocked;       // Threads blocked by uthread_block, which a foreign pthread may resume
+
+// Round robin within priority levels (UTHREAD_SCHED_RR)
+static ReadyQueue prio_queue;
+
+static void prio_enqueue(TCB* t)
+{
+  prio_queue.push_back(t);
+}
+
+static void prio_dequeue(TCB* t)
+{
+  prio_queue.remove(t);
+}
+
+static TCB* prio_pick_next()
+{
+  return prio_queue.pop_front();
+}
+
+static void rr_on_cpu_release(TCB* cur)
+{
+}
+
+static bool prio_should_preempt(TCB* cur)
+{
+  return !prio_queue.empty() && prio_queue.top_level() < cur->level;
+}
+
+static const SchedPolicy rr_policy = {
+    prio_enqueue, prio_dequeue, prio_pick_next, rr_on_cpu_release, rr_on_cpu_release, prio_should_preempt
+};
+
+// Multi-level feedback queue (UTHREAD_SCHED_MLFQ). Shares the priority levels with RR; a thread's level sinks one step
+// for every quantum it uses up, and periodic boosts put every thread back on the level of its priority. READY threads
+// are requeued at the boost; the others pick up the new level through boost_epoch when they are next made READY.
+static int mlfq_boost_quanta;
+static int last_boost;             // total_quantums at the last boost
+static unsigned boost_epoch;       // Number of boosts so far
+
+static void mlfq_enqueue(TCB* t)
+{
+  if (t->boost_epoch != boost_epoch)
+  {
+    t->level = t->priority;
+    t->boost_epoch = boost_epoch;
+  }
+  prio_queue.push_back(t);
+}
+
+static void mlfq_maybe_boost()
+{
+  if (total_quantums - last_boost < mlfq_boost_quanta)
+  {
+    return;
+  }
+  boost_epoch++;
+  last_boost = total_quantums;
+  RunList boosted;
+  while (TCB* t = prio_queue.pop_front())
+  {
+    boosted.push_back(t);
+  }
+  while (TCB* t = boosted.pop_front())
+  {
+    mlfq_enqueue(t);
+  }
+}
+
+static void mlfq_on_tick(TCB* cur)
+{
+  if (cur->level < UTHREAD_PRIO_LEVELS - 1)
+  {
+    cur->level++;
+  }
+  mlfq_maybe_boost();
+}
+
+static void mlfq_on_block(TCB* cur)
+{
+  mlfq_maybe_boost();
+}
+
+static const SchedPolicy mlfq_policy = {
+    mlfq_enqueue, prio_dequeue, prio_pick_next, mlfq_on_tick, mlfq_on_block, prio_should_preempt
+};
+
+// Proportional share (UTHREAD_SCHED_STRIDE, UTHREAD_SCHED_CFS). Both run the READY thread with the smallest vkey and
+// only differ in how they charge for CPU time. fair_min_vkey follows the key of the last picked thread; a thread that
+// comes back from blocking is placed no further than fair_wake_credit behind it, so it cannot bank CPU time while
+// it is away. Neither policy preempts the running thread on a wakeup.
+#define STRIDE_ONE (1LL << 32)
+
+static FairTree fair_tree;
+static int64_t fair_min_vkey;
+static int64_t fair_wake_credit;
+
+static void fair_enqueue(TCB* t)
+{
+  if (t->vkey < fair_min_vkey - fair_wake_credit)
+  {
+    t->vkey = fair_min_vkey - fair_wake_credit;
+  }
+  fair_tree.insert(t);
+}
+
+static void fair_dequeue(TCB* t)
+{
+  fair_tree.erase(t);
+}
+
+static TCB* fair_pick_next()
+{
+  TCB* t = fair_tree.leftmost;
+  fair_tree.erase(t);
+  if (t->vkey > fair_min_vkey)
+  {
+    fair_min_vkey = t->vkey;
+  }
+  t->run_start = monotonic_ns();
+  return t;
+}
+
+static bool fair_should_preempt(TCB* cur)
+{
+  return false;
+}
+
+// STRIDE advances the pass by a whole stride per quantum the thread was given, however much of it was used
+static void stride_charge(TCB* cur)
+{
+  cur->vkey += STRIDE_ONE / cur->weight;
+}
+
+static const SchedPolicy stride_policy = {
+    fair_enqueue, fair_dequeue, fair_pick_next, stride_charge, stride_charge, fair_should_preempt
+};
+
+// CFS advances the virtual runtime by the nanoseconds used, scaled by UTHREAD_WEIGHT_DEFAULT / weight
+static void cfs_charge(TCB* cur)
+{
+  if (cur->run_start != 0)
+  {
+    cur->vkey += (monotonic_ns() - cur->run_start) * UTHREAD_WEIGHT_DEFAULT / cur->weight;
+  }
+}
+
+static const SchedPolicy cfs_policy = {
+    fair_enqueue, fair_dequeue, fair_pick_next, cfs_charge, cfs_charge, fair_should_preempt
+};
+
+// Earliest-deadline-first class. It sits above the policy: READY EDF threads are not handed to the policy, and the
+// one with the earliest deadline runs before anything the policy holds. A thread that has spent its budget is
+// throttled by putting it on the sleep heap until its period ends. EDF threads are expected to be few, so they are
+// kept in a plain list and scanned.
+#define EDF_UTIL_ONE 1000000000LL      // Utilization of a thread that may use every quantum
+
+static std::vector<TCB*> edf_threads;
+static long long edf_util;             // Sum of budget/period over edf_threads, in EDF_UTIL_ONE units
+static int edf_nr_ready;               // READY threads in edf_threads
+
+static inline bool is_edf(TCB* t)
+{
+  return t->edf_period > 0;
+}
+
+static long long edf_utilization(int period, int budget)
+{
+  return (budget * EDF_UTIL_ONE + period - 1) / period;
+}
+
+// READY EDF thread with the earliest deadline, or nullptr
+static TCB* edf_earliest()
+{
+  TCB* best = nullptr;
+  if (edf_nr_ready == 0)
+  {
+    return nullptr;
+  }
+  for (TCB* t : edf_threads)
+  {
+    if (t->state == READY && (best == nullptr || t->edf_deadline < best->edf_deadline))
+    {
+      best = t;
+    }
+  }
+  return best;
+}
+
+// Hold back an EDF thread that has spent its budget until its period ends
+static void edf_throttle(TCB* t)
+{
+  t->state = BLOCKED;
+  t->block_reasons |= BLOCK_SLEEP;
+  t->wake_time = t->edf_deadline;
+  t->edf_throttled = true;
+  sleepers.push(t);
+}
+
+// Drop t from the EDF class. t must not be READY.
+static void edf_leave(TCB* t)
+{
+  if (!is_edf(t))
+  {
+    return;
+  }
+  for (size_t i = 0; i < edf_threads.size(); i++)
+  {
+    if (edf_threads[i] == t)
+    {
+      edf_threads[i] = edf_threads.back();
+      edf_threads.pop_back();
+      break;
+    }
+  }
+  edf_util -= edf_utilization(t->edf_period, t->edf_budget);
+  t->edf_period = 0;
+}
+
+static int ready_interactive;      // READY best-effort threads with TCB::interactive set
+
+// Resume the periodic tick at the end of the current quantum, for a thread that should not wait out a stretched
+// or stopped one
+static void tick_restart()
+{
+  sync_quanta();
+  long long left_ns = quantum_usecs * 1000LL - (timer_clock_ns() - tick_start_ns);
+  arm_timer(left_ns > 1000 ? left_ns / 1000 : 1);
+  tick_program = 1;
+}
+
+// Arm the timer for the thread about to run. With neither tickless nor adaptive mode the tick stays periodic and
+// nothing is done; otherwise the next tick is pushed out to the first quantum that can change the decision.
+static void tick_plan(TCB* next)
+{
+  if (!tickless && adaptive_quantum <= 1)
+  {
+    return;
+  }
+  int n = 1;
+  if (edf_threads.empty())
+  {
+    if (tickless && nr_ready == 0 && explicit_blocked == 0)
+    {
+      n = 0; // Nothing to switch to, and no wakeup from a foreign pthread to look out for
+    }
+    else if (adaptive_quantum > 1 && ready_interactive == 0)
+    {
+      n = next->slice;
+    }
+    if (n != 1 && !sleepers.empty())
+    {
+      int due = sleepers.top()->wake_time - total_quantums;
+      if (n == 0 || due < n) n = due < 1 ? 1 : due;
+    }
+    if (n != 1 && policy == &mlfq_policy && nr_ready > 0)
+    {
+      int due = last_boost + mlfq_boost_quanta - total_quantums;
+      if (n == 0 || due < n) n = due < 1 ? 1 : due;
+    }
+  }
+  if (n == 1 && tick_program == 1)
+  {
+    return;
+  }
+  arm_timer((long long)n * quantum_usecs);
+  tick_program = n;
+  tick_start_ns = timer_clock_ns();
+}
+
+// Chase-Lev work-stealing deque of READY threads (Chase and Lev, SPAA 2005, with the memory orderings of Le et al.,
+// PPoPP 2013), one per M:N worker. Only the owning worker pushes, at the bottom, holding sched_lock. Every worker takes
+// from the top with a CAS, the owner included, which keeps a worker's own threads in round-robin order; idle workers
+// steal without the lock. An entry is only a hint: it is checked under the lock when it is taken (see claim), and a
+// thread has at most one entry (TCB::queued), so a deque never holds more than tcb_capacity of them.
+struct WorkDeque
+{
+    struct Slots
+    {
+        int64_t size;                  // Power of two
+        std::atomic<TCB*>* slot;
+    };
+
+    std::atomic<int64_t> top;
+    std::atomic<int64_t> bottom;
+    std::atomic<Slots*> slots;
+
+    // Owner only, with sched_lock held
+    void push(TCB* t)
+    {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        Slots* s = slots.load(std::memory_order_relaxed);
+        s->slot[b & (s->size - 1)].store(t, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    // Any worker, with or without sched_lock. Returns nullptr if the deque is empty or another worker won the entry.
+    TCB* steal()
+    {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) return nullptr;
+        Slots* s = slots.load(std::memory_order_acquire);
+        TCB* x = s->slot[t & (s->size - 1)].load(std::memory_order_relaxed);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        {
+            return nullptr;
+        }
+        return x;
+    }
+
+    bool empty() const
+    {
+        return top.load(std::memory_order_acquire) >= bottom.load(std::memory_order_acquire);
+    }
+
+    // Make room for n entries, with sched_lock held. A thief may still be reading the old array, so it is not freed.
+    void reserve(int64_t n)
+    {
+        Slots* old = slots.load(std::memory_order_relaxed);
+        if (old != nullptr && old->size >= n) return;
+        Slots* s = new Slots;
+        s->size = 64;
+        while (s->size < n) s->size *= 2;
+        s->slot = new std::atomic<TCB*>[s->size];
+        int64_t end = old != nullptr ? bottom.load(std::memory_order_relaxed) : 0;
+        for (int64_t i = top.load(std::memory_order_relaxed); i < end; i++)
+        {
+            s->slot[i & (s->size - 1)].store(old->slot[i & (old->size - 1)].load(std::memory_order_relaxed),
+                                             std::memory_order_relaxed);
+        }
+        slots.store(s, std::memory_order_release);
+    }
+};
+
+#define WORKER_STACK_SIZE (64 * 1024)   // Idle-loop and SIGSEGV stacks of an M:N worker
+
+struct Worker
+{
+    pthread_t thread;
+    WorkDeque deque;
+    TCB idle;                          // Context of worker_idle; not in the thread table
+    char* segv_stack;                  // Signal stacks are per kernel thread
+};
+
+static Worker* workers;
+static thread_local Worker* this_worker;
+static int busy_workers;                   // Workers running a thread rather than their idle loop
+static std::atomic<int> idle_waiters;      // Workers sleeping on work_seq
+static std::atomic<uint32_t> work_seq;     // Futex word, bumped when a thread becomes READY while a worker sleeps
+
+// Wakeups posted by pthreads outside the library (uthread_resume_from_foreign): a stack of TCBs linked through
+// TCB::foreign_next that producers push with a CAS and the scheduler takes whole with one exchange, so neither side
+// locks. TCB::foreign_queued keeps a thread on it at most once. A scheduler with nothing to run is kicked through
+// wake_fd (idle() polls it while idle_parked is set) or, in M:N mode, through work_seq.
+static std::atomic<TCB*> foreign_wakeups;
+static std::atomic<bool> idle_parked;
+static int wake_fd = -1;
+
+static long futex(std::atomic<uint32_t>* word, int op, uint32_t val, const struct timespec* timeout)
+{
+  return syscall(SYS_futex, (uint32_t*)word, op | FUTEX_PRIVATE_FLAG, val, timeout, nullptr, 0);
+}
+
+// Check a deque entry under the lock: it only counts if its thread is still live and READY. A stale entry is left by
+// a READY thread that was blocked or terminated and is simply dropped.
+static TCB* claim(TCB* t)
+{
+  t->queued = false;
+  bool live = tid_in_use[t->id / 64] & (1ULL << (t->id % 64));
+  if (!live || t->state != READY)
+  {
+    return nullptr;
+  }
+  nr_ready--;
+  t->cpu = (int)(this_worker - workers);
+  return t;
+}
+
+// Take an entry from any deque, starting with this worker's own. Claims nothing, so it needs no lock.
+static TCB* steal_any()
+{
+  int self = (int)(this_worker - workers);
+  for (int i = 0; i < nworkers; i++)
+  {
+    WorkDeque* d = &workers[(self + i) % nworkers].deque;
+    while (!d->empty())
+    {
+      TCB* t = d->steal();
+      if (t != nullptr) return t;
+    }
+  }
+  return nullptr;
+}
+
+// Policy-independent bookkeeping around the hooks
+static void make_ready(TCB* t)
+{
+  if (nworkers > 1)
+  {
+    // Queue it on this worker; a sleeping worker is woken to steal it
+    t->state = READY;
+    nr_ready++;
+    if (!t->queued)
+    {
+      t->queued = true;
+      this_worker->deque.push(t);
+    }
+    if (idle_waiters.load(std::memory_order_relaxed) > 0)
+    {
+      work_seq.fetch_add(1);
+      futex(&work_seq, FUTEX_WAKE, 1, nullptr);
+    }
+    return;
+  }
+
+  if (is_edf(t))
+  {
+    if (t->edf_remaining == 0)
+    {
+      edf_throttle(t);
+      return;
+    }
+    t->state = READY;
+    nr_ready++;
+    edf_nr_ready++;
+  }
+  else
+  {
+    t->state = READY;
+    nr_ready++;
+    if (t->interactive) ready_interactive++;
+    policy->enqueue(t);
+  }
+
+  // Spawned or woken while the running thread has the timer stretched or stopped
+  if (tick_program == 0 || (tick_program > 1 && (t->interactive || is_edf(t))))
+  {
+    tick_restart();
+  }
+}
+
+static void remove_ready(TCB* t)
+{
+  nr_ready--;
+  if (nworkers > 1)
+  {
+    return; // Its deque entry goes stale
+  }
+  if (is_edf(t))
+  {
+    edf_nr_ready--;
+    return;
+  }
+  if (t->interactive) ready_interactive--;
+  policy->dequeue(t);
+}
+
+// Remove and return the thread to run next. In M:N mode that is the first valid entry in this worker's deque or,
+// failing that, one stolen from another worker; nullptr if there is none, even with nr_ready > 0 when an idle worker
+// holds the entry.
+static TCB* take_next()
+{
+  if (nworkers > 1)
+  {
+    int self = (int)(this_worker - workers);
+    for (int i = 0; i < nworkers && nr_ready > 0; i++)
+    {
+      WorkDeque* d = &workers[(self + i) % nworkers].deque;
+      while (nr_ready > 0 && !d->empty())
+      {
+        TCB* t = d->steal();
+        if (t != nullptr && (t = claim(t)) != nullptr) return t;
+      }
+    }
+    return nullptr;
+  }
+
+  nr_ready--;
+  TCB* t = edf_earliest();
+  if (t != nullptr)
+  {
+    edf_nr_ready--;
+    t->edf_remaining--;
+    return t;
+  }
+  t = policy->pick_next();
+  if (t->interactive) ready_interactive--;
+  return t;
+}
+
+// Ask for a switch at the end of the current critical section if a READY thread should run before the current one
+static void check_preempt()
+{
+  if (nworkers > 1)
+  {
+    return; // Deques are first come, first served
+  }
+  TCB* cur = tcb(current_tid);
+  TCB* edf = edf_earliest();
+  bool preempt;
+  if (is_edf(cur))
+  {
+    preempt = edf != nullptr && edf->edf_deadline < cur->edf_deadline;
+  }
+  else
+  {
+    preempt = edf != nullptr || policy->should_preempt(cur);
+  }
+  if (preempt)
+  {
+    preempt_resched = 1;
+  }
+}
+
+// Return the TCB of a live thread, or nullptr if tid does not name one
+static TCB* lookup(int tid)
+{
+  if (tid < 0 || tid >= tcb_capacity) return nullptr;
+  if (!(tid_in_use[tid / 64] & (1ULL << (tid % 64)))) return nullptr;
+  TCB* t = tcb(tid);
+  return t->state == ZOMBIE ? nullptr : t;
+}
+
+// Like lookup, but also return a zombie
+static TCB* lookup_joinable(int tid)
+{
+  if (tid < 0 || tid >= tcb_capacity) return nullptr;
+  if (!(tid_in_use[tid / 64] & (1ULL << (tid % 64)))) return nullptr;
+  return tcb(tid);
+}
+
+// Map one more chunk of TCBs. The sleep heap is grown with it so that it can hold every thread.
+static bool grow_tcb_table()
+{
+  void* chunk = mmap(nullptr, TCB_CHUNK * sizeof(TCB), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (chunk == MAP_FAILED)
+  {
+    return false;
+  }
+  tcb_chunks[tcb_capacity / TCB_CHUNK] = (TCB*)chunk;
+  __atomic_store_n(&tcb_capacity, tcb_capacity + TCB_CHUNK, __ATOMIC_RELEASE);   // Read by foreign pthreads
+  sleepers.resize(tcb_capacity);
+  for (int i = 0; i < nworkers && workers != nullptr; i++)
+  {
+    workers[i].deque.reserve(tcb_capacity);
+  }
+  return true;
+}
+
+// Claim the smallest free tid, or return -1 if the limit is reached. The scan starts at tid_hint, so filling the
+// table is O(1) per tid however many threads are live.
+static int alloc_tid()
+{
+  for (int w = tid_hint; w < TID_WORDS; w++)
+  {
+    uint64_t free_bits = ~tid_in_use[w];
+    if (free_bits == 0) continue;
+    tid_hint = w;
+    int tid = w * 64 + __builtin_ctzll(free_bits);
+    if (tid >= thread_limit) return -1;
+    if (tid >= tcb_capacity && !grow_tcb_table()) return -1;
+    tid_in_use[w] |= 1ULL << (tid % 64);
+    num_threads++;
+    return tid;
+  }
+  return -1;
+}
+
+static void free_tid(int tid)
+{
+  retired_stats.add(tcb(tid)->stats);
+  tid_in_use[tid / 64] &= ~(1ULL << (tid % 64));
+  if (tid / 64 < tid_hint) tid_hint = tid / 64;
+  num_threads--;
+}
+
+// Clear one block reason and hand the thread to the policy if none remain
+static void unblock(TCB* t, int reason)
+{
+  if (t->block_reasons & reason & BLOCK_EXPLICIT) explicit_blocked--;
+  t->block_reasons &= ~reason;
+  if (t->state == BLOCKED && t->block_reasons == 0)
+  {
+    t->stat_stamp = t->stat_woken = stats_stamp();
+    trace(UTHREAD_TRACE_WAKE, t->id, 0, t->stat_woken);
+    make_ready(t);
+    check_preempt();
+  }
+}
+
+// Deliver the wakeups posted by uthread_resume_from_foreign, oldest first. A wakeup only resumes a thread that is
+// still blocked by uthread_block. Must be called inside a critical section.
+static void drain_foreign()
+{
+  // The stack holds the newest wakeup first; reverse it while every entry is still marked queued
+  TCB* list = foreign_wakeups.exchange(nullptr);
+  TCB* oldest = nullptr;
+  while (list != nullptr)
+  {
+    TCB* next = list->foreign_next;
+    list->foreign_next = oldest;
+    oldest = list;
+    list = next;
+  }
+
+  while (oldest != nullptr)
+  {
+    TCB* t = oldest;
+    oldest = t->foreign_next;
+    t->foreign_queued.store(false);
+    if (lookup(t->id) == t && t->state == BLOCKED && (t->block_reasons & BLOCK_EXPLICIT))
+    {
+      trace(UTHREAD_TRACE_RESUME, t->id, 0, stats_stamp());
+      unblock(t, BLOCK_EXPLICIT);
+    }
+  }
+}
+
+// Start the next period of every EDF thread whose deadline has passed. A thread that is still runnable or throttled
+// at that point did not finish its job in time.
+static void edf_replenish()
+{
+  for (TCB* t : edf_threads)
+  {
+    if (t->edf_deadline > total_quantums)
+    {
+      continue;
+    }
+    while (t->edf_deadline <= total_quantums)
+    {
+      if (t->state != BLOCKED || t->edf_throttled)
+      {
+        t->edf_misses++;
+      }
+      t->edf_deadline += t->edf_period;
+    }
+    t->edf_remaining = t->edf_budget;
+    if (t->edf_throttled)
+    {
+      t->edf_throttled = false;
+      sleepers.remove(t);
+      t->wake_time = -1;
+      unblock(t, BLOCK_SLEEP);
+    }
+  }
+}
+
+// Wake every sleeper whose deadline has been reached
+static void wake_sleepers()
+{
+  if (!edf_threads.empty())
+  {
+    edf_replenish();
+  }
+  while (!sleepers.empty() && sleepers.top()->wake_time <= total_quantums)
+  {
+    TCB* t = sleepers.pop();
+    t->wake_time = -1;
+    unblock(t, BLOCK_SLEEP);
+  }
+}
+
+// Wait queues of synchronization objects reuse the TCB run-list links, since a parked thread is never READY. The
+// public uthread_waitq_t holds them untyped, so they are manipulated through a RunList copy.
+static void waitq_push(uthread_waitq_t* q, TCB* t)
+{
+  RunList list((TCB*)q->head, (TCB*)q->tail);
+  list.push_back(t);
+  q->head = list.head;
+  q->tail = list.tail;
+}
+
+static void waitq_remove(uthread_waitq_t* q, TCB* t)
+{
+  RunList list((TCB*)q->head, (TCB*)q->tail);
+  list.remove(t);
+  q->head = list.head;
+  q->tail = list.tail;
+}
+
+// Park the running thread on q until another thread hands it the object. Must be called inside a critical section.
+static void park(uthread_waitq_t* q, int reason = BLOCK_WAIT)
+{
+  TCB* self = tcb(current_tid);
+  self->state = BLOCKED;
+  self->block_reasons |= reason;
+  self->waitq = q;
+  waitq_push(q, self);
+  schedule();
+}
+
+// Take the first thread parked on q off the queue and let it run again; returns it, or nullptr if q is empty
+static TCB* wake_first(uthread_waitq_t* q, int reason = BLOCK_WAIT)
+{
+  TCB* t = (TCB*)q->head;
+  if (t == nullptr) return nullptr;
+  waitq_remove(q, t);
+  t->waitq = nullptr;
+  unblock(t, reason);
+  return t;
+}
+
+// A thread has ended with the exit value value. A thread waiting in uthread_join gets the value and the tid is
+// released; an unjoined joinable thread stays a ZOMBIE until it is joined or detached. A released TCB and stack slot
+// are recycled by the spawn that gets the tid next.
+static void retire(TCB* t, void* value)
+{
+  edf_leave(t);
+  TCB* joiner = wake_first(&t->join_waiters);
+  if (joiner != nullptr)
+  {
+    joiner->wait_msg = value;
+  }
+  else if (t->joinable)
+  {
+    t->state = ZOMBIE;
+    t->exit_value = value;
+    return;
+  }
+  free_tid(t->id);
+}
+
+// I/O reactor. A thread whose non-blocking I/O call would block parks on the fd's reader or writer queue, and the
+// fd is armed in a one-shot epoll registration for the directions that have waiters. The scheduler polls epoll at
+// every scheduling decision while anyone is waiting, and blocks in it when no thread is READY.
+struct FdWaiters
+{
+  uthread_waitq_t readers;
+  uthread_waitq_t writers;
+  bool registered;           // fd has been added to epoll_fd
+};
+
+// Parked threads point at these queues through TCB::waitq, so they must never move. They are mapped in chunks of
+// FD_CHUNK as higher fds are waited on, through a directory sized once from the RLIMIT_NOFILE hard limit.
+#define FD_CHUNK 1024
+
+static int epoll_fd = -1;
+static FdWaiters** fd_chunks;               // Indexed by fd / FD_CHUNK; chunks are mapped only from wait_fd
+static int fd_chunk_count;                  // Entries in fd_chunks
+static int io_waiting;                      // Threads parked on an fd
+
+static inline FdWaiters& fd_waiters(int fd)
+{
+  return fd_chunks[fd / FD_CHUNK][fd % FD_CHUNK];
+}
+
+// Map the fd directory and the epoll instance on first use. Returns -1 with errno set on failure.
+static int init_reactor()
+{
+  struct rlimit lim;
+  if (getrlimit(RLIMIT_NOFILE, &lim) < 0) return -1;
+  rlim_t max_fds = (lim.rlim_max == RLIM_INFINITY || lim.rlim_max > INT_MAX) ? (rlim_t)INT_MAX : lim.rlim_max;
+  int count = (int)((max_fds + FD_CHUNK - 1) / FD_CHUNK);
+  void* dir = mmap(nullptr, count * sizeof(FdWaiters*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (dir == MAP_FAILED) return -1;
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0)
+  {
+    int saved_errno = errno;
+    munmap(dir, count * sizeof(FdWaiters*));
+    errno = saved_errno;
+    return -1;
+  }
+  fd_chunks = (FdWaiters**)dir;
+  fd_chunk_count = count;
+  return 0;
+}
+
+// (Re)arm fd for the directions that still have waiters. Must be called inside a critical section.
+static int arm_fd(int fd)
+{
+  FdWaiters& w = fd_waiters(fd);
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLONESHOT;
+  if (w.readers.head != nullptr) ev.events |= EPOLLIN | EPOLLRDHUP;
+  if (w.writers.head != nullptr) ev.events |= EPOLLOUT;
+  ev.data.fd = fd;
+
+  // The fd may have been closed and reused since we registered it, which drops the old registration
+  if (w.registered && epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0) return 0;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0 ||
+      (errno == EEXIST && epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0))
+  {
+    w.registered = true;
+    return 0;
+  }
+  return -1;
+}
+
+// Park the running thread until fd is ready for events (EPOLLIN or EPOLLOUT). Must be called inside a critical
+// section. Returns -1 with errno set if fd cannot be watched.
+static int wait_fd(int fd, uint32_t events)
+{
+  if (epoll_fd < 0 && init_reactor() < 0)
+  {
+    return -1;
+  }
+  if (fd < 0 || fd / FD_CHUNK >= fd_chunk_count)
+  {
+    errno = EBADF;
+    return -1;
+  }
+  if (fd_chunks[fd / FD_CHUNK] == nullptr)
+  {
+    // mmap zeroes the chunk, so every queue starts empty and unregistered
+    void* chunk = mmap(nullptr, FD_CHUNK * sizeof(FdWaiters), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1, 0);
+    if (chunk == MAP_FAILED) return -1;
+    fd_chunks[fd / FD_CHUNK] = (FdWaiters*)chunk;
+  }
+
+  uthread_waitq_t* q = (events & EPOLLIN) ? &fd_waiters(fd).readers : &fd_waiters(fd).writers;
+  TCB* self = tcb(current_tid);
+  self->waitq = q;
+  waitq_push(q, self);
+  if (arm_fd(fd) < 0)
+  {
+    int saved_errno = errno;
+    waitq_remove(q, self);
+    self->waitq = nullptr;
+    errno = saved_errno;
+    return -1;
+  }
+
+  // Already queued above; park() would queue us again, so block by hand
+  io_waiting++;
+  self->state = BLOCKED;
+  self->block_reasons |= BLOCK_IO;
+  schedule();
+  return 0;
+}
+
+// Collect ready fds from epoll and wake their waiters. timeout_ms is passed to epoll_wait (-1 blocks).
+// Must be called inside a critical section.
+static void poll_io(int timeout_ms)
+{
+  static struct epoll_event events[64];   // Off the thread stacks, which may be as small as STACK_SIZE
+  int n = epoll_wait(epoll_fd, events, 64, timeout_ms);
+  for (int i = 0; i < n; i++)
+  {
+    int fd = events[i].data.fd;
+    FdWaiters& w = fd_waiters(fd);
+    uint32_t ev = events[i].events;
+
+    // Errors and hang-ups wake both sides so their retried call reports them
+    if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+    {
+      while (wake_first(&w.readers, BLOCK_IO) != nullptr) io_waiting--;
+    }
+    if (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+    {
+      while (wake_first(&w.writers, BLOCK_IO) != nullptr) io_waiting--;
+    }
+
+    // One-shot registrations are disarmed after firing; re-arm for anyone still waiting
+    if (w.readers.head != nullptr || w.writers.head != nullptr)
+    {
+      arm_fd(fd);
+    }
+  }
+}
+
+// Called when no thread is READY. The process waits in ppoll (on wake_fd, and on the epoll fd if any thread waits
+// for I/O) until a sleeper is due, an fd is ready, a foreign pthread posts a wakeup or a signal arrives. A wall-clock
+// timer keeps ticking meanwhile; its ticks are deferred by the critical section and each one counts as a new quantum
+// here. A CPU-time timer never fires while the process is idle, so instead the wait is bounded by the earliest
+// sleeper's deadline and idle wall-clock time is counted as elapsed quanta, which keeps sleep deadlines meaningful.
+// Must be called inside a critical section.
+static void idle()
+{
+  // A tickless timer is stopped while idle and the idle time counted here, as for a CPU-time clock
+  bool ticking = timer_is_wall_clock() && !tickless;
+  if (tickless)
+  {
+    arm_timer(0);
+    tick_program = -1;
+  }
+  else if (tick_program != 1)
+  {
+    arm_timer(quantum_usecs);
+    tick_program = 1;
+  }
+
+  while (nr_ready == 0)
+  {
+    if (sleepers.empty() && io_waiting == 0 && explicit_blocked == 0)
+    {
+      ErrorLine() << "thread library error: no threads to schedule\n";
+      exit(1); // Every thread is blocked and nothing can wake one
+    }
+
+    struct timespec timeout;
+    struct timespec* timeout_p = nullptr;
+    if (!sleepers.empty() && !ticking)
+    {
+      long long wait_ns = (long long)(sleepers.top()->wake_time - total_quantums) * quantum_usecs * 1000;
+      timeout.tv_sec = wait_ns / 1000000000;
+      timeout.tv_nsec = wait_ns % 1000000000;
+      timeout_p = &timeout;
+    }
+
+    // A foreign pthread writes wake_fd only once it sees idle_parked, so the queue is checked after setting it
+    struct pollfd pfd[2];
+    pfd[0].fd = wake_fd;
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+    pfd[1].fd = epoll_fd;
+    pfd[1].events = POLLIN;
+    long long start = monotonic_ns();
+    idle_parked.store(true);
+    if (foreign_wakeups.load() == nullptr)
+    {
+      ppoll(pfd, io_waiting > 0 ? 2 : 1, timeout_p, nullptr);
+    }
+    idle_parked.store(false);
+    long long idle_ns = monotonic_ns() - start;
+    stats_idle_ns += idle_ns;
+
+    if (ticking)
+    {
+      if (preempt_pending)
+      {
+        preempt_pending = 0;
+        total_quantums++;
+      }
+    }
+    else
+    {
+      total_quantums += (int)(idle_ns / (quantum_usecs * 1000LL));
+    }
+    wake_sleepers();
+    if (io_waiting > 0)
+    {
+      poll_io(0);
+    }
+    if (pfd[0].revents & POLLIN)
+    {
+      uint64_t count;
+      ssize_t ignored = read(wake_fd, &count, sizeof(count));   // Resets the eventfd
+      (void)ignored;
+    }
+    if (foreign_wakeups.load() != nullptr)
+    {
+      drain_foreign();
+    }
+  }
+}
+
+// Take a BLOCKED or READY thread out of every scheduler structure it is linked into
+static void unlink_thread(TCB* t)
+{
+  if (t->state == READY)
+  {
+    remove_ready(t);
+  }
+  else if (t->sleep_index >= 0)
+  {
+    sleepers.remove(t);
+  }
+  else if (t->waitq != nullptr)
+  {
+    waitq_remove(t->waitq, t);
+    if (t->block_reasons & BLOCK_IO) io_waiting--;
+  }
+  if (t->block_reasons & BLOCK_EXPLICIT) explicit_blocked--;
+}
+
+// Thread stacks. Slots are carved out of slabs of STACK_SLAB, one mmap per slab, and all slots of a slab have the
+// same size. The first page of a slot is a guard below the usable stack; the kernel commits the rest one page at a
+// time as the thread touches it. A PROT_NONE guard splits the mapping and the kernel caps mappings per process
+// (vm.max_map_count), so only guard_budget slots get one. Later slots leave the page accessible with a canary at its
+// top, checked whenever the thread is switched out: an overflow is then caught late, but within the dead page before
+// it reaches the neighbouring stack. A slot stays with its TCB when the thread terminates and returns to its pool
+// only when the TCB's next thread asks for a different size.
+#define STACK_SLAB 64
+#define STACK_CANARY 0x57a5c0de57a5c0deULL
+#define SCHED_STACK_RESERVE 8192   // Frames of the timer handler and scheduler on a preempted thread's stack
+
+// Free slots of one size. The low bit of an entry is set if that slot is guarded.
+struct StackPool
+{
+    size_t slot_len;
+    std::vector<uintptr_t> free_slots;
+};
+
+static size_t page_size;
+static size_t stack_reserve;       // Added to every requested size: signal frame plus SCHED_STACK_RESERVE
+static std::vector<StackPool> stack_pools;
+static long guard_budget;
+
+static uint64_t* stack_canary(TCB* t)
+{
+  return (uint64_t*)t->stack - 1;
+}
+
+static StackPool* stack_pool(size_t slot_len)
+{
+  for (StackPool& pool : stack_pools)
+  {
+    if (pool.slot_len == slot_len) return &pool;
+  }
+  stack_pools.push_back(StackPool());
+  stack_pools.back().slot_len = slot_len;
+  return &stack_pools.back();
+}
+
+// Map a new slab into pool. Returns false if it cannot be mapped.
+static bool carve_slab(StackPool* pool)
+{
+  size_t len = pool->slot_len * STACK_SLAB;
+  char* slab = (char*)mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+  if (slab == MAP_FAILED)
+  {
+    return false;
+  }
+  // Push in reverse so that slots are handed out in address order
+  for (int i = STACK_SLAB - 1; i >= 0; i--)
+  {
+    char* slot = slab + i * pool->slot_len;
+    uintptr_t entry = (uintptr_t)slot;
+    if (guard_budget > 0 && mprotect(slot, page_size, PROT_NONE) == 0)
+    {
+      guard_budget--;
+      entry |= 1;
+    }
+    pool->free_slots.push_back(entry);
+  }
+  return true;
+}
+
+// Give t a stack of at least size usable bytes for its own frames. Returns false if it cannot be mapped.
+static bool map_stack(TCB* t, size_t size)
+{
+  if (size > SIZE_MAX / 2)
+  {
+    return false;
+  }
+  size += stack_reserve;
+  size_t slot_len = ((size + page_size - 1) & ~(page_size - 1)) + page_size;
+  if (t->slot != nullptr && t->slot_len != slot_len)
+  {
+    stack_pool(t->slot_len)->free_slots.push_back((uintptr_t)t->slot | (t->guarded ? 1 : 0));
+    t->slot = nullptr;
+  }
+  if (t->slot == nullptr)
+  {
+    StackPool* pool = stack_pool(slot_len);
+    if (pool->free_slots.empty() && !carve_slab(pool))
+    {
+      return false;
+    }
+    uintptr_t entry = pool->free_slots.back();
+    pool->free_slots.pop_back();
+    t->slot = (char*)(entry & ~(uintptr_t)1);
+    t->slot_len = slot_len;
+    t->guarded = entry & 1;
+  }
+  t->stack = t->slot + page_size;
+  t->stack_size = slot_len - page_size;
+  if (!t->guarded)
+  {
+    *stack_canary(t) = STACK_CANARY;
+  }
+  return true;
+}
+
+// Report a stack overflow of thread tid; ErrorLine only uses write(2), since this also runs in signal context
+static void report_overflow(int tid)
+{
+  ErrorLine() << "thread library error: thread " << tid << " overflowed its stack\n";
+}
+
+// Build the first switch frame of a new thread so that switching to it calls start(t) on its own stack
+static void init_context(TCB* t, void (*start)(TCB*))
+{
+  uintptr_t top = ((uintptr_t)t->stack + t->stack_size) & ~(uintptr_t)15;
+#if defined(__x86_64__)
+  uint64_t* frame = (uint64_t*)top - 8;
+  memset(frame, 0, 8 * sizeof(uint64_t));
+  frame[0] = (0x037FULL << 32) | 0x1F80;          // default x87 control word and MXCSR
+  frame[3] = (uint64_t)start;                     // r13
+  frame[4] = (uint64_t)t;                         // r12
+  frame[7] = (uint64_t)uthread_context_trampoline; // return address
+#elif defined(__aarch64__)
+  uint64_t* frame = (uint64_t*)top - 22;
+  memset(frame, 0, 22 * sizeof(uint64_t));
+  frame[0] = (uint64_t)t;                         // x19
+  frame[1] = (uint64_t)start;                     // x20
+  frame[11] = (uint64_t)uthread_context_trampoline; // x30
+#endif
+  t->sp = frame;
+}
+
+// Switch from cur to next, which is already RUNNING, and return once cur is switched back in. The critical-section
+// depth and errno (shared by all threads of the process) live on our stack while we are away.
+static void switch_away(TCB* cur, TCB* next)
+{
+  if ((cur->state == BLOCKED && !cur->edf_throttled) || cur->yielding)
+  {
+    cur->stats.voluntary++;
+  }
+  else
+  {
+    cur->stats.involuntary++;
+  }
+  trace(UTHREAD_TRACE_SWITCH_OUT, cur->id, switch_reason(cur), switch_stamp);
+  int depth = preempt_depth;
+  int saved_errno = errno;
+  uthread_switch_context(&cur->sp, next->sp);
+  errno = saved_errno;
+  preempt_depth = depth;
+  stats_switch_in(cur);
+}
+
+// Make a scheduling decision and switch to the chosen thread. expired is set when the running thread is preempted
+// because its quantum ran out. Must be called inside a critical section; it returns once the current thread is
+// scheduled again.
+static void schedule(bool expired)
+{
+  TCB* cur = tcb(current_tid);
+
+  // A thread without a guard page that ran over its canary is terminated before anything else is overwritten
+  if (current_tid != 0 && !cur->guarded && *stack_canary(cur) != STACK_CANARY)
+  {
+    report_overflow(current_tid);
+    unlink_thread(cur);
+    uthread_terminate(current_tid);
+  }
+
+  // Account the time cur has run; whichever thread runs next times the switch from here
+  uint64_t now = stats_stamp();
+  cur->stats.cpu += now - cur->stat_stamp;
+  cur->stat_stamp = now;
+  switch_stamp = now;
+
+  // Increment total quantum count, after crediting the quanta a stretched or stopped tick let pass
+  if (tick_program != 1)
+  {
+    sync_quanta(expired);
+    tick_program = -1;
+  }
+  total_quantums++;
+
+  // Wake the sleeping threads that are due, those whose fds became ready and those resumed by foreign pthreads
+  wake_sleepers();
+  if (io_waiting > 0)
+  {
+    poll_io(0);
+  }
+  if (foreign_wakeups.load(std::memory_order_relaxed) != nullptr)
+  {
+    drain_foreign();
+  }
+
+  // Tell the policy how the current thread leaves the CPU; if it is still RUNNING, it goes back to READY (or is
+  // throttled, if it is an EDF thread that has spent its budget)
+  if (!is_edf(cur) && nworkers == 1)
+  {
+    if (expired && cur->state == RUNNING)
+    {
+      policy->on_tick(cur);
+    }
+    else
+    {
+      policy->on_block(cur);
+    }
+  }
+  if (adaptive_quantum > 1)
+  {
+    // A thread that used up its whole turn is CPU-bound and gets a longer one; one that gave up the CPU early is
+    // interactive and goes back to a single quantum
+    if (expired && cur->state == RUNNING)
+    {
+      cur->interactive = false;
+      cur->slice = cur->slice * 2 < adaptive_quantum ? cur->slice * 2 : adaptive_quantum;
+    }
+    else if (cur->state == BLOCKED)
+    {
+      cur->interactive = true;
+      cur->slice = 1;
+    }
+  }
+  if (cur->stop_requested && cur->state == RUNNING)
+  {
+    // Another worker is waiting for cur to leave the CPU (see stop_remote)
+    cur->state = BLOCKED;
+    cur->block_reasons |= BLOCK_STOP;
+  }
+  if (cur->state == RUNNING)
+  {
+    make_ready(cur);
+  }
+
+  // Select next thread to run, idling until one becomes READY
+  if (nr_ready == 0 && nworkers == 1)
+  {
+    idle();
+    switch_stamp = stats_stamp();
+  }
+
+  // Let the policy pick; nothing left READY should preempt its choice
+  TCB* next = take_next();
+  preempt_resched = 0;
+  if (next == nullptr)
+  {
+    // M:N: nothing to run here, so the worker goes idle
+    next = &this_worker->idle;
+    busy_workers--;
+    current_tid = -1;
+  }
+  else
+  {
+    tick_plan(next);
+
+    // Update state and quantum count for the next thread
+    current_tid = next->id;
+    next->state = RUNNING;
+    next->quantums++;
+  }
+
+  // Switch to the selected thread
+  if (next != cur)
+  {
+    switch_away(cur, next);
+  }
+}
+
+// Timer signal handler (SIGVTALRM, or SIGALRM for UTHREAD_CLOCK_REAL). It is installed with SA_NODEFER so the kernel
+// never leaves the signal blocked behind a switch; nesting is handled by the critical-section depth instead.
+void scheduler_handler(int signum)
+{
+  // A process-directed timer signal can land on a pthread the library does not run; pass it on
+  if (!runs_uthreads)
+  {
+    pthread_kill(init_thread, signum);
+    return;
+  }
+  if (preempt_depth > 0)
+  {
+    preempt_pending = 1;
+    return;
+  }
+  preempt_depth = 1;
+  if (nworkers > 1) sched_lock();
+  preempt_pending = 0;
+  schedule(true);
+  exit_critical();
+}
+
+// M:N: get t, RUNNING on another worker, off its CPU. Its worker is signalled and switches it out BLOCKED, which is
+// then undone here, so t ends up READY or BLOCKED for reasons of its own. Called inside a critical section; the lock
+// is dropped while waiting. Returns false if t terminated in the meantime.
+static bool stop_remote(TCB* t)
+{
+  unsigned gen = t->gen;
+  while (t->gen == gen && t->state == RUNNING)
+  {
+    t->stop_requested = true;
+    pthread_kill(workers[t->cpu].thread, timer_signal());
+    sched_unlock();
+    sched_yield();
+    sched_lock();
+
+    // Two workers stopping each other's threads would wait forever, so a stop aimed at the caller goes first
+    TCB* self = tcb(current_tid);
+    if (self->stop_requested && self->state == RUNNING)
+    {
+      schedule();
+    }
+  }
+  if (t->gen != gen)
+  {
+    return false;
+  }
+  t->stop_requested = false;
+  if (t->block_reasons & BLOCK_STOP)
+  {
+    unblock(t, BLOCK_STOP);
+  }
+  return lookup(t->id) == t;
+}
+
+// Idle loop of an M:N worker, run on a stack of its own while the worker has no thread. Like every switch, those into
+// and out of it are made holding sched_lock. While there is nothing to run it drops the lock, looks for an entry in
+// the deques without it, and otherwise sleeps on work_seq for up to a quantum. Worker 0 counts the quanta that pass
+// while every worker is idle, as idle() does, so that sleepers are still woken.
+static void worker_idle(TCB* idle)
+{
+  long long quantum_ns = quantum_usecs * 1000LL;
+  long long idle_carry_ns = 0;
+  for (;;)
+  {
+    preempt_depth = 1;
+    wake_sleepers();
+    if (io_waiting > 0)
+    {
+      poll_io(0);
+    }
+    if (foreign_wakeups.load(std::memory_order_relaxed) != nullptr)
+    {
+      drain_foreign();
+    }
+    TCB* next = take_next();
+
+    if (next == nullptr)
+    {
+      if (nr_ready == 0 && busy_workers == 0 && sleepers.empty() && io_waiting == 0 && explicit_blocked == 0)
+      {
+        ErrorLine() << "thread library error: no threads to schedule\n";
+        exit(1); // Every thread is blocked and nothing can wake one
+      }
+
+      uint32_t seq = work_seq.load();
+      idle_waiters++;
+      sched_unlock();
+      long long start = monotonic_ns();
+      // A foreign wakeup posted after the drain above has bumped work_seq, or is seen here
+      TCB* stolen = steal_any();
+      if (stolen == nullptr && foreign_wakeups.load() == nullptr)
+      {
+        struct timespec timeout;
+        timeout.tv_sec = quantum_ns / 1000000000;
+        timeout.tv_nsec = quantum_ns % 1000000000;
+        futex(&work_seq, FUTEX_WAIT, seq, &timeout);
+      }
+      long long idle_ns = monotonic_ns() - start;
+      sched_lock();
+      idle_waiters--;
+      stats_idle_ns += idle_ns;
+      if (this_worker == workers && busy_workers == 0)
+      {
+        idle_carry_ns += idle_ns;
+        total_quantums += (int)(idle_carry_ns / quantum_ns);
+        idle_carry_ns %= quantum_ns;
+      }
+      if (stolen == nullptr || (next = claim(stolen)) == nullptr)
+      {
+        continue;
+      }
+    }
+
+    // A tick noted while idle must not cut the new thread's quantum short
+    busy_workers++;
+    current_tid = next->id;
+    next->state = RUNNING;
+    next->quantums++;
+    total_quantums++;
+    preempt_pending = 0;
+    preempt_resched = 0;
+    switch_stamp = stats_stamp();
+    uthread_switch_context(&idle->sp, next->sp);
+  }
+}
+
+// Kernel thread of M:N workers 1 and up: set up what is per kernel thread, then enter the idle loop for good
+static void* worker_main(void* arg)
+{
+  Worker* w = (Worker*)arg;
+  this_worker = w;
+  runs_uthreads = true;
+  current_tid = -1;
+  preempt_depth = 1;
+
+  stack_t ss;
+  ss.ss_sp = w->segv_stack;
+  ss.ss_size = WORKER_STACK_SIZE;
+  ss.ss_flags = 0;
+  if (sigaltstack(&ss, nullptr) < 0)
+  {
+    perror("system error: sigaltstack");
+    exit(1);
+  }
+  timer_t timer;
+  create_timer(&timer);
+  struct itimerspec its;
+  its.it_interval.tv_sec = its.it_value.tv_sec = quantum_usecs / 1000000;
+  its.it_interval.tv_nsec = its.it_value.tv_nsec = (quantum_usecs % 1000000) * 1000L;
+  if (timer_settime(timer, 0, &its, nullptr) < 0)
+  {
+    perror("system error: timer_settime");
+    exit(1);
+  }
+
+  sched_lock();
+  void* boot_sp;
+  uthread_switch_context(&boot_sp, w->idle.sp);
+  return nullptr;
+}
+
+// SIGSEGV handler. It runs on its own signal stack because the faulting thread's stack is exhausted. A fault in the
+// running thread's guard page, or a signal frame the kernel could not push onto that thread's stack, is reported as
+// a stack overflow. If the thread overflowed in its own code, only that thread ends. Inside a critical section
+// (schedule() run from the timer handler, say, or anywhere sched_lock is held in M:N mode) the scheduler's structures
+// may be half-updated, so ending the thread could corrupt them; the process gets the default action instead, as it
+// does for any other fault.
+static char segv_stack[64 * 1024];
+
+static void segv_handler(int signum, siginfo_t* info, void* context)
+{
+  bool in_library = preempt_depth > 0;
+  TCB* t = current_tid > 0 ? tcb(current_tid) : nullptr;
+  if (t != nullptr && t->slot != nullptr)
+  {
+    ucontext_t* uc = (ucontext_t*)context;
+#if defined(__x86_64__)
+    char* sp = (char*)uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+    char* sp = (char*)uc->uc_mcontext.sp;
+#endif
+    char* addr = (char*)info->si_addr;
+    bool guard_hit = info->si_code != SI_KERNEL && t->guarded && addr >= t->slot && addr < t->stack;
+    bool frame_failed = info->si_code == SI_KERNEL && sp >= t->slot && sp < t->slot + t->slot_len;
+    if (guard_hit || frame_failed)
+    {
+      report_overflow(current_tid);
+      if (!in_library)
+      {
+        uthread_terminate(current_tid);
+      }
+    }
+  }
+  signal(SIGSEGV, SIG_DFL);
+}
+
+// First code run by every spawned thread. The switch that got us here was made inside a critical section, which
+// this thread now owns and leaves.
+static void thread_start(TCB* self)
+{
+  stats_switch_in(self);
+  preempt_depth = 1;
+  exit_critical();
+
+  if (self->entry != nullptr)
+  {
+    self->entry();
+  }
+  else
+  {
+    self->arg_entry(self->arg);
+  }
+  uthread_terminate(self->id);
+}
+
+// Switch the library to M:N mode with n workers. Called by uthread_init_ex inside its critical section, which from
+// here on holds sched_lock like any other.
+static void start_workers(int n)
+{
+  // Zeroed pages, like the TCB chunks
+  workers = (Worker*)mmap(nullptr, n * sizeof(Worker), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (workers == MAP_FAILED)
+  {
+    perror("system error: mmap");
+    exit(1);
+  }
+  for (int i = 0; i < n; i++)
+  {
+    Worker* w = &workers[i];
+    w->deque.reserve(tcb_capacity);
+    w->idle.reset(-1);
+    w->idle.stack_size = WORKER_STACK_SIZE;
+    w->idle.stack = (char*)mmap(nullptr, 2 * WORKER_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                                -1, 0);
+    if (w->idle.stack == MAP_FAILED)
+    {
+      perror("system error: mmap");
+      exit(1);
+    }
+    w->segv_stack = w->idle.stack + WORKER_STACK_SIZE;
+    init_context(&w->idle, worker_idle);
+  }
+  workers[0].thread = pthread_self();
+  this_worker = &workers[0];
+  busy_workers = 1;
+  nworkers = n;
+  sched_lock();
+
+  for (int i = 1; i < n; i++)
+  {
+    int err = pthread_create(&workers[i].thread, nullptr, worker_main, &workers[i]);
+    if (err != 0)
+    {
+      errno = err;
+      perror("system error: pthread_create");
+      exit(1);
+    }
+  }
+}
+
+/**
+ * @brief initializes the thread library.
+ * @brief initializes the thread library.
+ *
+ * Once this function returns, the main thread (tid == 0) will be set as RUNNING. There is no need to
+ * provide an entry_point or to create a stack for the main thread - it will be using the "regular" stack and PC.
+ * You may assume that this function is called before any other thread library function, and that it is called
+ * exactly once.
+ * The input to the function is the length of a quantum in micro-seconds.
+ * It is an error to call this function with non-positive quantum_usecs.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_init(int quantum_usecs)
+{
+  return uthread_init_ex(quantum_usecs, nullptr);
+}
+
+/**
+ * @brief initializes the thread library like uthread_init, with the configuration in attr (NULL for defaults).
+ *
+ * attr->clock selects what a quantum measures. The CPU-time clocks (VIRTUAL, PROCESS_CPU) suit batch work: a thread
+ * doing I/O does not use up quanta while it waits. The wall-clock clocks (REAL, MONOTONIC) give latency-sensitive
+ * services time slices of fixed real length. POSIX timers deliver their signal to the calling kernel thread
+ * (SIGEV_THREAD_ID) where the platform supports it. With a wall-clock timer, quanta keep being counted while every
+ * thread is blocked, so uthread_sleep measures real time; with a CPU-time clock the library counts idle wall-clock
+ * time in quanta itself. UTHREAD_CLOCK_REAL takes over SIGALRM, so the application must not use alarm(2).
+ *
+ * attr->sched selects the scheduling policy. RR and MLFQ always run a thread of the highest priority level that
+ * has a READY thread, and a thread that becomes READY with a higher level than the running one preempts it at once.
+ * Under UTHREAD_SCHED_MLFQ a thread that is still running when its quantum expires drops one level, a thread that
+ * blocks or sleeps before that keeps its level, and every attr->mlfq_boost_quanta quanta all threads are raised back
+ * to their priority so that CPU-bound threads cannot starve. STRIDE and CFS ignore priorities and share the CPU in
+ * proportion to thread weights. STRIDE charges a whole quantum whenever a thread leaves the CPU, even if it blocked
+ * early; CFS charges the nanoseconds actually used and lets a thread that wakes from a long sleep run soon, though
+ * it does not preempt the running thread.
+ *
+ * With attr->workers > 1 the threads are run by that many kernel threads (M:N mode), the calling thread being the
+ * first of them. Each worker keeps its own run queue, appends the threads it makes READY to it, and steals from the
+ * others when its own is empty; all library calls still go through a single scheduler lock. M:N mode requires
+ * UTHREAD_CLOCK_MONOTONIC, UTHREAD_SCHED_RR and a periodic tick, with every worker having its own timer; priorities
+ * and weights have no effect, a thread that becomes READY never preempts a running one, and uthread_set_deadline
+ * fails. uthread_preempt_disable keeps other workers out of the library but not out of their threads' own code, so
+ * data shared between threads needs a uthread_mutex_t. A thread may resume on a different kernel thread after any
+ * library call or preemption, so it must not keep thread_local data or pthread_self() across them.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_init_ex(int quantum_usecs, const uthread_init_attr_t* attr)
+{
+  // Enter critical section
+  enter_critical();
+
+  uthread_init_attr_t defaults;
+  memset(&defaults, 0, sizeof(defaults));
+  if (attr == nullptr)
+  {
+    attr = &defaults;
+  }
+
+  // 1. validate the input
+  if (quantum_usecs <= 0)
+  {
+    ErrorLine() << "thread library error: quantum_usecs must be positive\n";
+    exit_critical();
+    return -1;
+  }
+  if (attr->clock < UTHREAD_CLOCK_VIRTUAL || attr->clock > UTHREAD_CLOCK_PROCESS_CPU)
+  {
+    ErrorLine() << "thread library error: unknown timer clock\n";
+    exit_critical();
+    return -1;
+  }
+
+  if (attr->sched < UTHREAD_SCHED_RR || attr->sched > UTHREAD_SCHED_CFS || attr->mlfq_boost_quanta < 0)
+  {
+    ErrorLine() << "thread library error: invalid scheduling policy\n";
+    exit_critical();
+    return -1;
+  }
+
+  if (attr->adaptive_quantum < 0)
+  {
+    ErrorLine() << "thread library error: adaptive_quantum must not be negative\n";
+    exit_critical();
+    return -1;
+  }
+
+  if (attr->workers < 0 || attr->workers > UTHREAD_WORKERS_MAX ||
+      (attr->workers > 1 && (attr->clock != UTHREAD_CLOCK_MONOTONIC || attr->sched != UTHREAD_SCHED_RR ||
+                             attr->tickless || attr->adaptive_quantum > 1)))
+  {
+    ErrorLine() << "thread library error: invalid worker count, or M:N mode without UTHREAD_CLOCK_MONOTONIC, "
+                   "UTHREAD_SCHED_RR and a periodic tick\n";
+    exit_critical();
+    return -1;
+  }
+
+  ::quantum_usecs = quantum_usecs;
+  timer_clock = attr->clock;
+  static const SchedPolicy* const policies[] = {&rr_policy, &mlfq_policy, &stride_policy, &cfs_policy};
+  policy = policies[attr->sched];
+  mlfq_boost_quanta = attr->mlfq_boost_quanta > 0 ? attr->mlfq_boost_quanta : 100;
+  fair_wake_credit = quantum_usecs * 1000LL / 2;
+  tickless = attr->tickless != 0;
+  adaptive_quantum = attr->adaptive_quantum;
+
+  // 2. Stacks are mapped in slabs; overflows into their guard pages are caught on a separate signal stack. Guard
+  //    pages may use up to a quarter of the process's mapping limit.
+  page_size = (size_t)sysconf(_SC_PAGESIZE);
+  long signal_frame = MINSIGSTKSZ;
+#ifdef _SC_MINSIGSTKSZ
+  if (sysconf(_SC_MINSIGSTKSZ) > signal_frame)
+  {
+    signal_frame = sysconf(_SC_MINSIGSTKSZ);
+  }
+#endif
+  stack_reserve = (size_t)signal_frame + SCHED_STACK_RESERVE;
+  long max_map_count = 65530;
+  int fd = open("/proc/sys/vm/max_map_count", O_RDONLY);
+  if (fd >= 0)
+  {
+    char buf[32];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    if (n > 0)
+    {
+      buf[n] = '\0';
+      max_map_count = atol(buf);
+    }
+    close(fd);
+  }
+  guard_budget = max_map_count / 4;
+  stack_t ss;
+  ss.ss_sp = segv_stack;
+  ss.ss_size = sizeof(segv_stack);
+  ss.ss_flags = 0;
+  if (sigaltstack(&ss, nullptr) < 0)
+  {
+    perror("system error: sigaltstack");
+    exit(1);
+  }
+  struct sigaction segv = {0};
+  segv.sa_sigaction = segv_handler;
+  sigemptyset(&segv.sa_mask);
+  segv.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_NODEFER;
+  if (sigaction(SIGSEGV, &segv, nullptr) < 0)
+  {
+    perror("system error: sigaction");
+    exit(1);
+  }
+
+  // 3. Install the scheduler handler for the timer's signal, which it takes on this kernel thread from now on
+  runs_uthreads = true;
+  init_thread = pthread_self();
+  struct sigaction sa = {0}; // Declare and initialize sa
+  sa.sa_handler = scheduler_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART | SA_NODEFER;
+  if (sigaction(timer_signal(), &sa, nullptr) < 0)
+  {
+    perror("system error: sigaction");
+    exit(1);
+  }
+
+  // 4. Set up the timer
+  if (timer_clock != UTHREAD_CLOCK_VIRTUAL && timer_clock != UTHREAD_CLOCK_REAL)
+  {
+    create_timer(&posix_timer);
+  }
+  arm_timer(quantum_usecs);
+
+  // 4b. Eventfd through which uthread_resume_from_foreign wakes idle(); M:N workers are woken through work_seq
+  if (attr->workers <= 1)
+  {
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0)
+    {
+      perror("system error: eventfd failed");
+      exit(1);
+    }
+  }
+
+  // 5. Register the main thread TCB; its statistics start with the clock calibration
+  TCB* main_t = tcb(alloc_tid());
+  main_t->reset(0);
+  main_t->state = RUNNING;
+  main_t->quantums = 1;
+  stats_calibrate();
+  main_t->stat_stamp = stats_base;
+  current_tid = 0;
+  total_quantums = 1;
+
+  // 6. M:N mode: the calling thread becomes worker 0 and the other workers are started
+  if (attr->workers > 1)
+  {
+    start_workers(attr->workers);
+  }
+
+  exit_critical();
+  return 0;
+}
+
+// Create a thread that runs entry() or, if entry is null, arg_entry(arg)
+static int spawn(thread_entry_point entry, thread_arg_entry_point arg_entry, void* arg, const uthread_attr_t* attr)
+{
+  // Enter critical section
+  enter_critical();
+
+  // 1. validate the input
+  if (entry == nullptr && arg_entry == nullptr)
+  {
+    ErrorLine() << "thread library error: entry_point is null\n";
+    exit_critical();
+    return -1;
+  }
+
+  int priority = attr != nullptr ? attr->priority : 0;
+  int weight = (attr != nullptr && attr->weight != 0) ? attr->weight : UTHREAD_WEIGHT_DEFAULT;
+  if (priority < 0 || priority >= UTHREAD_PRIO_LEVELS || weight < 1 || weight > UTHREAD_WEIGHT_MAX)
+  {
+    ErrorLine() << "thread library error: invalid priority " << priority << " or weight " << weight << "\n";
+    exit_critical();
+    return -1;
+  }
+
+  if (num_threads >= thread_limit)
+  {
+    ErrorLine() << "thread library error: too many threads\n";
+    exit_critical();
+    return -1;
+  }
+
+  // 2. get smallest available thread ID
+  int tid = alloc_tid();
+  if (tid < 0)
+  {
+    ErrorLine() << "thread library error: no available thread ID\n";
+    exit_critical();
+    return -1;
+  }
+
+  // 3-4. Recycle the TCB of this tid and give it a stack, reusing the previous owner's slot when it fits
+  TCB* new_t = tcb(tid);
+  new_t->reset(tid);
+  new_t->stat_stamp = stats_stamp();
+  trace(UTHREAD_TRACE_SPAWN, tid, 0, new_t->stat_stamp);
+  size_t stack_size = (attr != nullptr && attr->stack_size != 0) ? attr->stack_size : STACK_SIZE;
+  if (!map_stack(new_t, stack_size))
+  {
+    ErrorLine() << "thread library error: cannot allocate a stack of " << stack_size << " bytes\n";
+    free_tid(tid);
+    exit_critical();
+    return -1;
+  }
+
+  // 5-6. Set up stack and context; the first switch into the thread enters thread_start
+  new_t->entry = entry;
+  new_t->arg_entry = arg_entry;
+  new_t->arg = arg;
+  init_context(new_t, thread_start);
+
+  // 7. Hand it to the policy
+  new_t->priority = new_t->level = priority;
+  new_t->boost_epoch = boost_epoch;
+  new_t->weight = weight;
+  new_t->joinable = attr != nullptr && attr->joinable;
+  make_ready(new_t);
+  check_preempt();
+
+  // Leave critical section
+  exit_critical();
+  return tid;
+}
+
+/**
+ * @brief Creates a new thread, whose entry point is the function entry_point with the signature
+ * void entry_point(void).
+ *
+ * The thread is added to the end of the READY threads list.
+ * The uthread_spawn function should fail if it would cause the number of concurrent threads to exceed the
+ * limit (MAX_THREAD_NUM unless changed with uthread_set_thread_limit).
+ * Each thread should be allocated with a stack of size STACK_SIZE bytes.
+ * It is an error to call this function with a null entry_point.
+ *
+ * @return On success, return the ID of the created thread. On failure, return -1.
+ */
+int uthread_spawn(thread_entry_point entry_point)
+{
+  return uthread_spawn_ex(entry_point, nullptr);
+}
+
+/**
+ * @brief Creates a new thread like uthread_spawn, with the attributes in attr (NULL for defaults).
+ *
+ * The stack is reserved with mmap below a PROT_NONE guard page and memory is only committed as the thread touches
+ * it, so a large attr->stack_size costs address space rather than RAM. A thread that overflows into its guard page
+ * in its own code is reported on stderr and terminated, and the rest of the process keeps running; an overflow inside
+ * the library (in a critical section) is reported and then kills the process.
+ *
+ * @return On success, return the ID of the created thread. On failure, return -1.
+ */
+int uthread_spawn_ex(thread_entry_point entry_point, const uthread_attr_t* attr)
+{
+  return spawn(entry_point, nullptr, nullptr, attr);
+}
+
+/**
+ * @brief Creates a new thread like uthread_spawn, whose entry point entry_point is called with the argument arg.
+ *
+ * @return On success, return the ID of the created thread. On failure, return -1.
+ */
+int uthread_spawn_arg(thread_arg_entry_point entry_point, void* arg)
+{
+  return spawn(nullptr, entry_point, arg, nullptr);
+}
+
+/**
+ * @brief Sets the maximal number of concurrent threads, including the main thread.
+ *
+ * Thread control blocks and stacks are allocated in chunks as threads are spawned, so a high limit costs nothing
+ * until it is used. The limit may be changed at any time, before or after uthread_init. It is an error to set it
+ * below the number of live threads or above UTHREAD_THREAD_LIMIT_MAX.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_set_thread_limit(int limit)
+{
+  // Enter critical section
+  enter_critical();
+
+  if (limit < 1 || limit > UTHREAD_THREAD_LIMIT_MAX || limit < num_threads)
+  {
+    ErrorLine() << "thread library error: invalid thread limit " << limit << "\n";
+    exit_critical();
+    return -1;
+  }
+  thread_limit = limit;
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Sets the priority of the thread with ID tid, from 0 (highest) to UTHREAD_PRIO_LEVELS - 1.
+ *
+ * A READY thread only runs when no thread of a higher priority is READY; threads of equal priority share the CPU
+ * round robin. Under UTHREAD_SCHED_MLFQ the priority is the level the thread starts at and returns to on every boost.
+ * The proportional-share policies ignore priorities. If no thread with ID tid exists it is considered an error.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_set_priority(int tid, int priority)
+{
+  // Enter critical section
+  enter_critical();
+
+  // 1. validate the input
+  TCB* t = lookup(tid);
+  if (t == nullptr || priority < 0 || priority >= UTHREAD_PRIO_LEVELS)
+  {
+    ErrorLine() << "thread library error: invalid thread ID " << tid << " or priority " << priority << "\n";
+    exit_critical();
+    return -1;
+  }
+
+  // 2. Move the thread to its new level; a READY thread is requeued at the tail
+  bool was_ready = t->state == READY;
+  if (was_ready)
+  {
+    remove_ready(t);
+  }
+  t->priority = t->level = priority;
+  t->boost_epoch = boost_epoch;
+  if (was_ready)
+  {
+    make_ready(t);
+  }
+
+  // 3. Give up the CPU at once if a READY thread now outranks the running one
+  check_preempt();
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Sets the CPU share weight of the thread with ID tid, from 1 to UTHREAD_WEIGHT_MAX.
+ *
+ * Under UTHREAD_SCHED_STRIDE and UTHREAD_SCHED_CFS a thread that is READY as often as another one gets CPU time in
+ * proportion to its weight. The other policies ignore weights. If no thread with ID tid exists it is considered an
+ * error.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_set_weight(int tid, int weight)
+{
+  // Enter critical section
+  enter_critical();
+
+  TCB* t = lookup(tid);
+  if (t == nullptr || weight < 1 || weight > UTHREAD_WEIGHT_MAX)
+  {
+    ErrorLine() << "thread library error: invalid thread ID " << tid << " or weight " << weight << "\n";
+    exit_critical();
+    return -1;
+  }
+
+  // The weight only scales future charges, so a READY thread keeps its place
+  t->weight = weight;
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Moves the thread with ID tid into the earliest-deadline-first real-time class, or back out of it.
+ *
+ * The thread gets budget quanta in every period of period quanta, starting with the current quantum. READY EDF
+ * threads always run before best-effort threads, the one with the earliest deadline (end of its current period)
+ * first, and one that becomes READY preempts any best-effort thread at once. Every quantum an EDF thread runs in
+ * uses one quantum of its budget; once the budget is spent the thread is held back until its next period. A new
+ * reservation is only admitted if the budget/period of all EDF threads adds up to at most 1. The job of a period
+ * counts as done once the thread blocks, sleeps or calls uthread_wait_next_period; a thread that is still runnable
+ * or out of budget when its period ends has missed its deadline. period == 0 returns the thread to its best-effort
+ * policy. It is an error to use the main thread (tid == 0), a nonexistent tid, or 0 < period < budget, or to set
+ * a reservation in M:N mode (uthread_init_ex with attr->workers > 1).
+ *
+ * @return On success, return 0. If admission control rejects the reservation, or on any other failure, return -1.
+ */
+int uthread_set_deadline(int tid, int period, int budget)
+{
+  // Enter critical section
+  enter_critical();
+
+  // 1. validate the input
+  TCB* t = lookup(tid);
+  if (tid == 0 || t == nullptr || period < 0 || (period > 0 && (budget < 1 || budget > period)))
+  {
+    ErrorLine() << "thread library error: invalid thread ID " << tid << " or EDF reservation\n";
+    exit_critical();
+    return -1;
+  }
+
+  if (period > 0 && nworkers > 1)
+  {
+    ErrorLine() << "thread library error: EDF reservations are not available in M:N mode\n";
+    exit_critical();
+    return -1;
+  }
+
+  // 2. Admission control: the new reservation replaces the thread's old one, if any
+  long long old_util = is_edf(t) ? edf_utilization(t->edf_period, t->edf_budget) : 0;
+  long long new_util = period > 0 ? edf_utilization(period, budget) : 0;
+  if (edf_util - old_util + new_util > EDF_UTIL_ONE)
+  {
+    ErrorLine() << "thread library error: EDF reservation exceeds the available CPU\n";
+    exit_critical();
+    return -1;
+  }
+
+  // 3. Take the thread out of wherever its current class keeps it
+  bool was_ready = t->state == READY;
+  if (was_ready)
+  {
+    remove_ready(t);
+  }
+  bool was_throttled = t->edf_throttled;
+  if (was_throttled)
+  {
+    t->edf_throttled = false;
+    sleepers.remove(t);
+    t->wake_time = -1;
+  }
+
+  // 4. Set up the new reservation, starting a fresh period now. EDF budgets are charged at every tick.
+  if (period > 0)
+  {
+    if (tick_program != 1)
+    {
+      tick_restart();
+    }
+    if (!is_edf(t))
+    {
+      edf_threads.push_back(t);
+      t->edf_misses = 0;
+    }
+    edf_util += new_util - old_util;
+    t->edf_period = period;
+    t->edf_budget = budget;
+    t->edf_remaining = budget;
+    t->edf_deadline = total_quantums + period;
+  }
+  else
+  {
+    edf_leave(t);
+  }
+
+  // 5. Put it back under its new class
+  if (was_ready)
+  {
+    make_ready(t);
+  }
+  if (was_throttled)
+  {
+    unblock(t, BLOCK_SLEEP);
+  }
+  check_preempt();
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Ends the current period's job of the calling EDF thread: it sleeps until its next period starts.
+ *
+ * It is an error to call this function from a thread outside the EDF class.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_wait_next_period(void)
+{
+  // Enter critical section
+  enter_critical();
+
+  TCB* self = tcb(current_tid);
+  if (!is_edf(self))
+  {
+    ErrorLine() << "thread library error: thread " << current_tid << " is not an EDF thread\n";
+    exit_critical();
+    return -1;
+  }
+
+  // Sleep on the heap until the period ends; edf_replenish starts the next one before the sleep is over
+  self->state = BLOCKED;
+  self->block_reasons |= BLOCK_SLEEP;
+  self->wake_time = self->edf_deadline;
+  sleepers.push(self);
+  schedule();
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Returns the number of deadlines the thread with ID tid has missed since it joined the EDF class.
+ *
+ * If no thread with ID tid exists it is considered an error.
+ *
+ * @return On success, return the number of missed deadlines. On failure, return -1.
+ */
+int uthread_get_deadline_misses(int tid)
+{
+  // Enter critical section
+  enter_critical();
+
+  TCB* t = lookup(tid);
+  if (t == nullptr)
+  {
+    ErrorLine() << "thread library error: thread ID " << tid << " does not exist\n";
+    exit_critical();
+    return -1;
+  }
+  int misses = t->edf_misses;
+
+  // Leave critical section
+  exit_critical();
+  return misses;
+}
+
+// End thread t with the exit value value. Called inside a critical section, which it leaves; it returns only when t
+// is another thread.
+static int end_thread(TCB* t, void* value)
+{
+  int tid = t->id;
+
+  // 1. If it's the main thread, clean up everything and exit
+  if (tid == 0)
+  {
+    // TCB chunks and stack slabs are mappings, released with the process
+    exit(0);
+  }
+
+  // 2. Terminating another thread
+  if (tid != current_tid)
+  {
+    // a) Remove it from the ready queue, the sleep heap or the wait queue it is parked on
+    trace(UTHREAD_TRACE_TERMINATE, tid, 0, stats_stamp());
+    unlink_thread(t);
+
+    // b) Hand over its exit value and release the tid, unless it has to wait for a joiner
+    retire(t, value);
+
+    exit_critical();
+    return 0;
+  }
+
+  // 3. Terminating self (tid == current_tid)
+  //    Nothing can reuse our tid or stack before we jump away, since we stay in the critical section until then.
+  uint64_t now = stats_stamp();
+  t->stats.cpu += now - t->stat_stamp;
+  switch_stamp = now;
+  trace(UTHREAD_TRACE_TERMINATE, tid, 0, now);
+  trace(UTHREAD_TRACE_SWITCH_OUT, tid, UTHREAD_TRACE_EXIT, now);
+
+  // a) Hand over the exit value, which wakes a thread waiting to join us
+  retire(t, value);
+
+  // b) If no other thread can ever run again, just exit
+  if (nr_ready == 0 && sleepers.empty() && io_waiting == 0 && explicit_blocked == 0 &&
+      (nworkers == 1 || busy_workers == 1))
+  {
+    exit(0);
+  }
+
+  if (tick_program != 1)
+  {
+    sync_quanta();
+    tick_program = -1;
+  }
+  total_quantums++; // Increment total quantums
+  if (nr_ready == 0 && nworkers == 1)
+  {
+    idle();
+    switch_stamp = stats_stamp();
+  }
+
+  // c) Dequeue the next thread; in M:N mode the worker may have to go idle instead
+  TCB* next = take_next();
+  preempt_resched = 0;
+  if (next == nullptr)
+  {
+    next = &this_worker->idle;
+    busy_workers--;
+    current_tid = -1;
+  }
+  else
+  {
+    tick_plan(next);
+
+    // d) Switch state
+    next->state = RUNNING;
+    next->quantums++;
+    current_tid = next->id;
+  }
+
+  // e) Switch to the next thread for good. It takes over the critical section when it resumes; the context saved
+  //    into our TCB is never used.
+  uthread_switch_context(&t->sp, next->sp);
+
+  // Unreachable
+  return 0;
+}
+
+/**
+ * @brief Terminates the thread with ID tid and deletes it from all relevant control structures.
+ *
+ * All the resources allocated by the library for this thread should be released. If no thread with ID tid exists it
+ * is considered an error. Terminating the main thread (tid == 0) will result in the termination of the entire
+ * process using exit(0) (after releasing the assigned library memory).
+ *
+ * @return The function returns 0 if the thread was successfully terminated and -1 otherwise. If a thread terminates
+ * itself or the main thread is terminated, the function does not return.
+ */
+int uthread_terminate(int tid)
+{
+  // Enter critical section
+  enter_critical();
+
+  // Find the thread in our table; in M:N mode one running on another worker is first switched out
+  TCB* t = lookup(tid);
+  if (t != nullptr && nworkers > 1 && tid != 0 && tid != current_tid && t->state == RUNNING && !stop_remote(t))
+  {
+    t = nullptr;
+  }
+  if (t == nullptr)
+  {
+    ErrorLine() << "thread library error: thread ID " << tid << " does not exist\n";
+    exit_critical();
+    return -1;
+  }
+
+  return end_thread(t, nullptr);
+}
+
+/**
+ * @brief Terminates the calling thread with the exit value value, which uthread_join hands to the thread joining it.
+ *
+ * Returning from the entry point, or being terminated with uthread_terminate, ends a thread with a NULL exit value.
+ * Called from the main thread, it ends the process like uthread_terminate(0).
+ *
+ * @return The function does not return.
+ */
+void uthread_exit(void* value)
+{
+  enter_critical();
+  end_thread(tcb(current_tid), value);
+}
+
+/**
+ * @brief Waits for the thread with ID tid to terminate and stores its exit value in *result, unless result is NULL.
+ *
+ * Only a thread spawned with attr->joinable set can be joined. The caller is BLOCKED until the thread terminates.
+ * A joinable thread that terminates before anyone joins it becomes a zombie: it keeps its tid, so that no new
+ * thread can be given that tid before uthread_join collects the exit value and releases it, but every other
+ * function treats it as gone. It is an error to join a thread that does not exist, is not joinable, is already being
+ * joined, is the caller, or is itself joining the caller.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_join(int tid, void** result)
+{
+  // Enter critical section
+  enter_critical();
+
+  // 1. validate the input
+  TCB* self = tcb(current_tid);
+  TCB* t = lookup_joinable(tid);
+  if (t == nullptr || t == self || !t->joinable || t->join_waiters.head != nullptr || t->waitq == &self->join_waiters)
+  {
+    ErrorLine() << "thread library error: thread ID " << tid << " cannot be joined\n";
+    exit_critical();
+    return -1;
+  }
+
+  // 2. Collect a zombie at once; otherwise wait for the thread to hand over its exit value as it terminates
+  void* value;
+  if (t->state == ZOMBIE)
+  {
+    value = t->exit_value;
+    free_tid(tid);
+  }
+  else
+  {
+    self->wait_msg = nullptr;
+    park(&t->join_waiters);
+    value = self->wait_msg;
+  }
+  if (result != nullptr)
+  {
+    *result = value;
+  }
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Detaches the thread with ID tid: its tid is released as soon as it terminates, or at once if it is a zombie.
+ *
+ * It is an error to detach a thread that does not exist or that another thread is joining.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_detach(int tid)
+{
+  // Enter critical section
+  enter_critical();
+
+  TCB* t = lookup_joinable(tid);
+  if (t == nullptr || t->join_waiters.head != nullptr)
+  {
+    ErrorLine() << "thread library error: thread ID " << tid << " cannot be detached\n";
+    exit_critical();
+    return -1;
+  }
+  if (t->state == ZOMBIE)
+  {
+    free_tid(tid);
+  }
+  else
+  {
+    t->joinable = false;
+  }
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Blocks the thread with ID tid. The thread may be resumed later using uthread_resume.
+ *
+ * If no thread with ID tid exists it is considered as an error. In addition, it is an error to try blocking the
+ * main thread (tid == 0). If a thread blocks itself, a scheduling decision should be made. Blocking a thread in
+ * BLOCKED state has no effect and is not considered an error.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_block(int tid)
+{
+  // Enter critical section
+  enter_critical();
+
+  // 1. validate the input; in M:N mode a thread running on another worker is first switched out
+  TCB* t = lookup(tid);
+  if (t != nullptr && nworkers > 1 && tid != 0 && tid != current_tid && t->state == RUNNING && !stop_remote(t))
+  {
+    t = nullptr;
+  }
+  if (tid == 0 || t == nullptr)
+  {
+    ErrorLine() << "thread library error: invalid thread ID " << tid << "\n";
+    exit_critical();
+    return -1;
+  }
+
+  if (!(t->block_reasons & BLOCK_EXPLICIT)) explicit_blocked++;
+  t->block_reasons |= BLOCK_EXPLICIT; // Mark as explicitly blocked
+  trace(UTHREAD_TRACE_BLOCK, tid, 0, stats_stamp());
+
+  // 2. Check if already blocked
+  if (t->state == BLOCKED)
+  {
+    exit_critical();
+    return 0; // No effect, already blocked
+  }
+
+  // If in READY state, take it back from the policy
+  if (t->state == READY)
+  {
+    remove_ready(t);
+  }
+
+  // 3. Block the thread and update state
+  t->state = BLOCKED;
+
+  // 4. If blocking self, schedule next thread
+  if (tid == current_tid)
+  {
+    schedule();
+  }
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Resumes a blocked thread with ID tid and moves it to the READY state.
+ *
+ * Resuming a thread in a RUNNING or READY state has no effect and is not considered as an error. If no thread with
+ * ID tid exists it is considered an error.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_resume(int tid)
+{
+  // Enter critical section
+  enter_critical();
+
+  // 1. validate the input
+  TCB* t = lookup(tid);
+  if (t == nullptr)
+  {
+    ErrorLine() << "thread library error: invalid thread ID " << tid << "\n";
+    exit_critical();
+    return -1;
+  }
+
+  trace(UTHREAD_TRACE_RESUME, tid, 0, stats_stamp());
+
+  // 2. Check if already in READY state
+  if (t->state == READY)
+  {
+    exit_critical();
+    return 0; // No effect, already in READY state
+  }
+
+  // 3. Clear the explicit block; a sleeping thread stays BLOCKED until its wake time
+  if (t->state == BLOCKED)
+  {
+    unblock(t, BLOCK_EXPLICIT);
+    exit_critical();
+    return 0;
+  }
+
+  // 4. If resuming self, schedule next thread
+  if (tid == current_tid)
+  {
+    schedule();
+  }
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Resumes the thread with ID tid like uthread_resume, but may be called from any kernel thread, including
+ * pthreads the library does not run, such as the completion callbacks of another library's thread pool.
+ *
+ * The call only queues the wakeup, with a few atomic operations: it takes no lock and never blocks. The scheduler
+ * delivers queued wakeups at its next scheduling point (the next tick or library call that switches threads), or at
+ * once if it has nothing to run. A wakeup resumes the thread only if it is blocked by uthread_block at that point,
+ * and several wakeups queued before one is delivered count as one. As a blocked thread may be resumed this way at
+ * any time, the library does not report a deadlock while some thread is blocked by uthread_block; with
+ * attr->tickless it also keeps the tick running. tid is only checked against the size of the thread table, so the
+ * caller must make sure that it still names the intended thread when the wakeup is delivered.
+ *
+ * A thread that hands a request to a foreign pthread and then blocks until it is done should do both with
+ * preemption disabled (uthread_preempt_disable), so that the wakeup cannot be delivered, and lost, in between.
+ *
+ * @return On success, return 0. If tid is out of range, return -1.
+ */
+int uthread_resume_from_foreign(int tid)
+{
+  // 1. validate the input against the table size only; the thread itself is checked when the wakeup is delivered
+  if (tid < 0 || tid >= __atomic_load_n(&tcb_capacity, __ATOMIC_ACQUIRE))
+  {
+    ErrorLine() << "thread library error: invalid thread ID " << tid << "\n";
+    return -1;
+  }
+
+  // 2. Push the thread onto the wakeup stack, unless a wakeup for it is already queued
+  TCB* t = tcb(tid);
+  if (!t->foreign_queued.exchange(true))
+  {
+    TCB* head = foreign_wakeups.load(std::memory_order_relaxed);
+    do
+    {
+      t->foreign_next = head;
+    } while (!foreign_wakeups.compare_exchange_weak(head, t));
+  }
+
+  // 3. Kick a scheduler that has nothing to run
+  if (nworkers > 1)
+  {
+    work_seq.fetch_add(1);
+    if (idle_waiters.load() > 0)
+    {
+      futex(&work_seq, FUTEX_WAKE, 1, nullptr);
+    }
+  }
+  else if (idle_parked.load())
+  {
+    uint64_t one = 1;
+    ssize_t ignored = write(wake_fd, &one, sizeof(one));
+    (void)ignored;
+  }
+  return 0;
+}
+
+/**
+ * @brief Blocks the RUNNING thread for num_quantums quantums.
+ *
+ * Immediately after the RUNNING thread transitions to the BLOCKED state a scheduling decision should be made.
+ * After the sleeping time is over, the thread should go back to the end of the READY queue.
+ * If the thread which was just RUNNING should also be added to the READY queue, or if multiple threads wake up
+ * at the same time, the order in which they're added to the end of the READY queue doesn't matter.
+ * The number of quantums refers to the number of times a new quantum starts, regardless of the reason. Specifically,
+ * the quantum of the thread which has made the call to uthread_sleep isn’t counted.
+ * It is considered an error if the main thread (tid == 0) calls this function.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_sleep(int num_quantums)
+{
+  // Enter critical section
+  enter_critical();
+
+  // 1. validate the input
+  if (num_quantums <= 0 || current_tid == 0)
+  {
+    ErrorLine() << "thread library error: invalid sleep time or main thread\n";
+    exit_critical();
+    return -1;
+  }
+
+  // 2. Block the RUNNING thread and queue it on the sleep heap
+  TCB* self = tcb(current_tid);
+  sync_quanta();
+  self->state = BLOCKED;
+  self->block_reasons |= BLOCK_SLEEP;
+  self->wake_time = total_quantums + num_quantums + 1;
+  sleepers.push(self);
+  self->stat_sleep_start = stats_stamp();
+  self->stat_sleep_ns = num_quantums * quantum_usecs * 1000LL;
+
+  // 3. Schedule next thread
+  schedule();
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Gives up the CPU: the calling thread goes back to READY, behind the threads already waiting under its
+ * scheduling policy, and the next thread runs.
+ *
+ * As when a thread blocks or sleeps, the next thread starts a new quantum, which uthread_get_total_quantums and that
+ * thread's uthread_get_quantums count. If no other thread is READY the caller keeps running and no quantum starts.
+ * STRIDE and CFS order threads by pass or virtual runtime rather than by arrival, so there the caller may be picked
+ * again right away.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_yield()
+{
+  // Enter critical section
+  enter_critical();
+
+  // With nothing else READY the caller keeps the CPU, and no quantum starts
+  if (nr_ready > 0)
+  {
+    TCB* cur = tcb(current_tid);
+    cur->yielding = true;
+    schedule();
+    cur->yielding = false;
+  }
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Switches straight to the READY thread with ID tid and hands it the rest of the current quantum.
+ *
+ * The calling thread goes back to READY as with uthread_yield, but tid runs next whatever the policy's order, so a
+ * producer can pass a request to its consumer without waiting for the other READY threads to take their turns. No
+ * new quantum starts: uthread_get_total_quantums stays the same and the timer is left alone, so tid is preempted
+ * when the caller's quantum (or adaptive turn) would have ended. tid's uthread_get_quantums still grows by one,
+ * since tid now runs in the current quantum. Threads handing the CPU back and forth this way therefore do not
+ * advance sleep deadlines or MLFQ boosts. Yielding to a thread that is not READY, or to the caller itself, has no
+ * effect and is not considered an error. If the caller or tid is an EDF thread the call acts like uthread_yield,
+ * so that deadlines keep their order. If no thread with ID tid exists it is considered an error.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_yield_to(int tid)
+{
+  // Enter critical section
+  enter_critical();
+
+  // 1. validate the input
+  TCB* t = lookup(tid);
+  if (t == nullptr)
+  {
+    ErrorLine() << "thread library error: invalid thread ID " << tid << "\n";
+    exit_critical();
+    return -1;
+  }
+  TCB* cur = tcb(current_tid);
+  if (t == cur || t->state != READY)
+  {
+    exit_critical();
+    return 0; // No effect
+  }
+
+  // 2. EDF threads, and a thread another worker is waiting to stop, go through the scheduler
+  cur->yielding = true;
+  if (is_edf(cur) || is_edf(t) || cur->stop_requested)
+  {
+    schedule();
+    cur->yielding = false;
+    exit_critical();
+    return 0;
+  }
+
+  // 3. Put the caller back to READY and take t out of the policy, without starting a new quantum
+  uint64_t now = stats_stamp();
+  cur->stats.cpu += now - cur->stat_stamp;
+  cur->stat_stamp = now;
+  switch_stamp = now;
+  remove_ready(t);
+  if (nworkers == 1)
+  {
+    policy->on_block(cur);
+  }
+  make_ready(cur);
+
+  // 4. Run t for the rest of the quantum; the timer keeps running as it is
+  if (nworkers > 1)
+  {
+    t->cpu = (int)(this_worker - workers);
+  }
+  if (policy == &cfs_policy)
+  {
+    t->run_start = monotonic_ns(); // CFS charges t from here, as if it had been picked
+  }
+  current_tid = tid;
+  t->state = RUNNING;
+  t->quantums++;
+  preempt_resched = 0;
+  switch_away(cur, t);
+  cur->yielding = false;
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Returns the thread ID of the calling thread.
+ *
+ * @return The ID of the calling thread.
+ */
+int uthread_get_tid()
+{
+  // Enter critical section
+  enter_critical();
+  int result = current_tid;
+  // Leave critical section
+  exit_critical();
+  return result;
+}
+
+/**
+ * @brief Returns the total number of quantums since the library was initialized, including the current quantum.
+ *
+ * Right after the call to uthread_init, the value should be 1.
+ * Each time a new quantum starts, regardless of the reason, this number should be increased by 1.
+ *
+ * @return The total number of quantums.
+ */
+int uthread_get_total_quantums()
+{
+  // Enter critical section
+  enter_critical();
+  sync_quanta();
+  int result = total_quantums;
+  // Leave critical section
+  exit_critical();
+
+  return result;
+}
+
+/**
+ * @brief Returns the number of quantums the thread with ID tid was in RUNNING state.
+ *
+ * On the first time a thread runs, the function should return 1. Every additional quantum that the thread starts should
+ * increase this value by 1 (so if the thread with ID tid is in RUNNING state when this function is called, include
+ * also the current quantum). If no thread with ID tid exists it is considered an error.
+ *
+ * @return On success, return the number of quantums of the thread with ID tid. On failure, return -1.
+ */
+int uthread_get_quantums(int tid)
+{
+  // Enter critical section
+  enter_critical();
+
+  TCB* t = lookup(tid);
+  if (t == nullptr)
+  {
+    ErrorLine() << "thread library error: invalid thread ID " << tid << "\n";
+    exit_critical();
+    return -1;
+  }
+
+  sync_quanta();
+  int result = t->quantums;
+
+  // Leave critical section
+  exit_critical();
+
+  return result;
+}
+
+/**
+ * @brief Fills *stats with the scheduler statistics of the thread with ID tid.
+ *
+ * Counters start at zero when the thread is spawned; the time of a RUNNING or READY thread includes its current
+ * stretch. Timestamps come from the CPU's cycle counter (rdtsc, or cntvct_el0 on AArch64), so keeping the counters
+ * costs a few nanoseconds per switch and no system calls. If no thread with ID tid exists or stats is null it is
+ * considered an error.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_get_stats(int tid, uthread_stats_t* stats)
+{
+  // Enter critical section
+  enter_critical();
+
+  TCB* t = lookup(tid);
+  if (t == nullptr || stats == nullptr)
+  {
+    ErrorLine() << "thread library error: invalid thread ID " << tid << " or null stats\n";
+    exit_critical();
+    return -1;
+  }
+  stats_export(stats_of(t), stats);
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Fills *stats with a snapshot of the scheduler statistics of the whole library since uthread_init.
+ *
+ * It is an error to call this function with a null stats.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_get_global_stats(uthread_global_stats_t* stats)
+{
+  // Enter critical section
+  enter_critical();
+
+  if (stats == nullptr)
+  {
+    ErrorLine() << "thread library error: stats is null\n";
+    exit_critical();
+    return -1;
+  }
+
+  // Terminated threads were folded into retired_stats; add every live one
+  ThreadStats sum = retired_stats;
+  for (int w = 0; w < tcb_capacity / 64; w++)
+  {
+    for (uint64_t bits = tid_in_use[w]; bits != 0; bits &= bits - 1)
+    {
+      sum.add(stats_of(tcb(w * 64 + __builtin_ctzll(bits))));
+    }
+  }
+  stats_export(sum, &stats->total);
+  stats->idle_ns = stats_idle_ns;
+  for (int i = 0; i < UTHREAD_HIST_BUCKETS; i++)
+  {
+    stats->switch_hist[i] = switch_hist[i];
+    stats->wakeup_hist[i] = wakeup_hist[i];
+  }
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Starts recording scheduling events into a ring buffer of nevents entries (rounded up to a power of two;
+ * 0 means 65536).
+ *
+ * The buffer is mapped once, here, and reused by later calls that fit in it; recording an event allocates nothing,
+ * takes no lock and makes no system call: it stores 16 bytes stamped with the CPU's cycle counter. When the ring
+ * is full the oldest events are overwritten. Restarting a trace discards the events recorded so far.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_trace_start(int nevents)
+{
+  // Enter critical section
+  enter_critical();
+
+  // 1. validate the input
+  if (nevents < 0 || nevents > (1 << 30))
+  {
+    ErrorLine() << "thread library error: invalid trace size " << nevents << "\n";
+    exit_critical();
+    return -1;
+  }
+  size_t size = 1;
+  while (size < (size_t)(nevents == 0 ? 65536 : nevents))
+  {
+    size <<= 1;
+  }
+
+  // 2. Map the ring, committed up front so that recording never faults
+  if (size > trace_mapped)
+  {
+    void* ring = mmap(nullptr, size * sizeof(uthread_trace_event_t), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (ring == MAP_FAILED)
+    {
+      ErrorLine() << "thread library error: cannot map a trace buffer of " << size << " events\n";
+      exit_critical();
+      return -1;
+    }
+    if (trace_ring != nullptr)
+    {
+      munmap(trace_ring, trace_mapped * sizeof(uthread_trace_event_t));
+    }
+    trace_ring = (uthread_trace_event_t*)ring;
+    trace_mapped = size;
+  }
+
+  // 3. Start over
+  trace_mask = size - 1;
+  trace_head = 0;
+  trace_on = true;
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Stops recording scheduling events. The recorded events stay available to uthread_trace_dump.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_trace_stop(void)
+{
+  trace_on = false;
+  return 0;
+}
+
+// write(2) all of buf, retrying after signals and short writes
+static bool write_all(int fd, const void* buf, size_t len)
+{
+  const char* p = (const char*)buf;
+  while (len > 0)
+  {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n <= 0)
+    {
+      return false;
+    }
+    p += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+/**
+ * @brief Writes the recorded events to fd: a uthread_trace_header_t followed by the events, oldest first.
+ *
+ * Only write(2) is used, so a dump can be taken from a signal handler, e.g. when the process is about to crash.
+ * The trace2json tool turns a dump into Chrome trace JSON, which chrome://tracing and Perfetto open. It is an error
+ * to call this function before uthread_trace_start.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_trace_dump(int fd)
+{
+  // Enter critical section
+  enter_critical();
+
+  if (trace_ring == nullptr)
+  {
+    ErrorLine() << "thread library error: no trace was started\n";
+    exit_critical();
+    return -1;
+  }
+
+  // 1. The header; the ring holds the newest trace_mask + 1 events at most
+  uint64_t count = trace_head <= trace_mask ? trace_head : trace_mask + 1;
+  uthread_trace_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, UTHREAD_TRACE_MAGIC, sizeof(header.magic));
+  header.version = UTHREAD_TRACE_VERSION;
+  header.event_size = sizeof(uthread_trace_event_t);
+  header.count = count;
+  header.dropped = trace_head - count;
+  bool ok = write_all(fd, &header, sizeof(header));
+
+  // 2. The events, oldest first, with cycle stamps turned into nanoseconds since initialization
+  unsigned __int128 num, den;
+  stats_ratio(&num, &den);
+  uthread_trace_event_t batch[64];
+  for (uint64_t i = trace_head - count; ok && i < trace_head;)
+  {
+    int n = 0;
+    for (; n < 64 && i < trace_head; n++, i++)
+    {
+      batch[n] = trace_ring[i & trace_mask];
+      uint64_t cycles = batch[n].ns > stats_base ? batch[n].ns - stats_base : 0;
+      batch[n].ns = (unsigned long long)(cycles * num / den);
+    }
+    ok = write_all(fd, batch, n * sizeof(uthread_trace_event_t));
+  }
+  if (!ok)
+  {
+    ErrorLine() << "thread library error: cannot write the trace to fd " << fd << "\n";
+    exit_critical();
+    return -1;
+  }
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Disables preemption of the calling thread until the matching uthread_preempt_enable.
+ *
+ * Calls nest. While preemption is disabled a quantum expiry is deferred, not lost: the switch happens as soon as the
+ * outermost uthread_preempt_enable runs. A thread that blocks, sleeps or terminates still gives up the CPU; it gets
+ * back its disabled state when it runs again. Intended for short critical sections shared between threads.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_preempt_disable()
+{
+  enter_critical();
+  return 0;
+}
+
+/**
+ * @brief Re-enables preemption disabled by uthread_preempt_disable, taking any deferred preemption.
+ *
+ * It is an error to call this function when preemption is not disabled.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_preempt_enable()
+{
+  if (preempt_depth <= 0)
+  {
+    ErrorLine() << "thread library error: preemption is not disabled\n";
+    return -1;
+  }
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Initializes a mutex to the unlocked state.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_mutex_init(uthread_mutex_t* mutex)
+{
+  if (mutex == nullptr)
+  {
+    ErrorLine() << "thread library error: mutex is null\n";
+    return -1;
+  }
+  memset(mutex, 0, sizeof(*mutex));
+  return 0;
+}
+
+/**
+ * @brief Destroys a mutex. It is an error to destroy a locked mutex.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_mutex_destroy(uthread_mutex_t* mutex)
+{
+  // Enter critical section
+  enter_critical();
+
+  if (mutex == nullptr || mutex->locked)
+  {
+    ErrorLine() << "thread library error: mutex is null or locked\n";
+    exit_critical();
+    return -1;
+  }
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Locks a mutex, parking the calling thread until it is handed the lock if another thread holds it.
+ *
+ * It is an error to lock a mutex already held by the calling thread.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_mutex_lock(uthread_mutex_t* mutex)
+{
+  // Enter critical section
+  enter_critical();
+
+  // 1. validate the input
+  if (mutex == nullptr || (mutex->locked && mutex->owner == current_tid))
+  {
+    ErrorLine() << "thread library error: mutex is null or already held by the caller\n";
+    exit_critical();
+    return -1;
+  }
+
+  // 2. Take a free mutex, or wait until the holder hands it to us
+  if (!mutex->locked)
+  {
+    mutex->locked = 1;
+    mutex->owner = current_tid;
+  }
+  else
+  {
+    park(&mutex->waiters);
+  }
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Locks a mutex if it is free, without blocking.
+ *
+ * @return 0 if the lock was taken, 1 if it is held, -1 on error.
+ */
+int uthread_mutex_trylock(uthread_mutex_t* mutex)
+{
+  // Enter critical section
+  enter_critical();
+
+  if (mutex == nullptr)
+  {
+    ErrorLine() << "thread library error: mutex is null\n";
+    exit_critical();
+    return -1;
+  }
+
+  int result = 1;
+  if (!mutex->locked)
+  {
+    mutex->locked = 1;
+    mutex->owner = current_tid;
+    result = 0;
+  }
+
+  // Leave critical section
+  exit_critical();
+  return result;
+}
+
+// Give a mutex held by the running thread to its first waiter, or unlock it. Must be called inside a critical section.
+static void mutex_release(uthread_mutex_t* mutex)
+{
+  TCB* next = wake_first(&mutex->waiters);
+  if (next != nullptr)
+  {
+    mutex->owner = next->id;
+  }
+  else
+  {
+    mutex->locked = 0;
+  }
+}
+
+/**
+ * @brief Unlocks a mutex held by the calling thread, handing it to the first waiter if there is one.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_mutex_unlock(uthread_mutex_t* mutex)
+{
+  // Enter critical section
+  enter_critical();
+
+  // 1. validate the input
+  if (mutex == nullptr || !mutex->locked || mutex->owner != current_tid)
+  {
+    ErrorLine() << "thread library error: mutex is null or not held by the caller\n";
+    exit_critical();
+    return -1;
+  }
+
+  // 2. Hand the lock to the first waiter
+  mutex_release(mutex);
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Initializes a condition variable.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_cond_init(uthread_cond_t* cond)
+{
+  if (cond == nullptr)
+  {
+    ErrorLine() << "thread library error: condition variable is null\n";
+    return -1;
+  }
+  memset(cond, 0, sizeof(*cond));
+  return 0;
+}
+
+/**
+ * @brief Destroys a condition variable. It is an error to destroy a condition variable that has waiters.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_cond_destroy(uthread_cond_t* cond)
+{
+  // Enter critical section
+  enter_critical();
+
+  if (cond == nullptr || cond->waiters.head != nullptr)
+  {
+    ErrorLine() << "thread library error: condition variable is null or has waiters\n";
+    exit_critical();
+    return -1;
+  }
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Atomically unlocks mutex and parks the calling thread on cond.
+ *
+ * The mutex must be held by the calling thread. When the thread is signalled it is queued for the mutex and only
+ * runs again once it holds it, so there are no wakeups that immediately block on the mutex.
+ *
+ * @return On success, return 0 with the mutex held again. On failure, return -1.
+ */
+int uthread_cond_wait(uthread_cond_t* cond, uthread_mutex_t* mutex)
+{
+  // Enter critical section
+  enter_critical();
+
+  // 1. validate the input
+  if (cond == nullptr || mutex == nullptr || !mutex->locked || mutex->owner != current_tid)
+  {
+    ErrorLine() << "thread library error: invalid condition variable or mutex not held by the caller\n";
+    exit_critical();
+    return -1;
+  }
+
+  // 2. Release the mutex and park on the condition variable. A signal moves us to the mutex queue, so by the time
+  //    we run again we own the mutex.
+  tcb(current_tid)->wait_mutex = mutex;
+  mutex_release(mutex);
+  park(&cond->waiters);
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+// Move the first waiter of cond to its mutex: it runs if the mutex is free, otherwise it queues for it.
+// Must be called inside a critical section. Returns false if cond has no waiters.
+static bool cond_wake_one(uthread_cond_t* cond)
+{
+  TCB* t = (TCB*)cond->waiters.head;
+  if (t == nullptr) return false;
+
+  uthread_mutex_t* mutex = t->wait_mutex;
+  t->wait_mutex = nullptr;
+  if (!mutex->locked)
+  {
+    mutex->locked = 1;
+    mutex->owner = t->id;
+    wake_first(&cond->waiters);
+  }
+  else
+  {
+    waitq_remove(&cond->waiters, t);
+    t->waitq = &mutex->waiters;
+    waitq_push(&mutex->waiters, t);
+  }
+  return true;
+}
+
+/**
+ * @brief Wakes the thread that has been waiting longest on cond, if any.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_cond_signal(uthread_cond_t* cond)
+{
+  // Enter critical section
+  enter_critical();
+
+  if (cond == nullptr)
+  {
+    ErrorLine() << "thread library error: condition variable is null\n";
+    exit_critical();
+    return -1;
+  }
+
+  cond_wake_one(cond);
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Wakes every thread waiting on cond.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_cond_broadcast(uthread_cond_t* cond)
+{
+  // Enter critical section
+  enter_critical();
+
+  if (cond == nullptr)
+  {
+    ErrorLine() << "thread library error: condition variable is null\n";
+    exit_critical();
+    return -1;
+  }
+
+  while (cond_wake_one(cond))
+  {
+  }
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Initializes a semaphore with a non-negative initial value.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_sem_init(uthread_sem_t* sem, int value)
+{
+  if (sem == nullptr || value < 0)
+  {
+    ErrorLine() << "thread library error: semaphore is null or initial value is negative\n";
+    return -1;
+  }
+  memset(sem, 0, sizeof(*sem));
+  sem->value = value;
+  return 0;
+}
+
+/**
+ * @brief Destroys a semaphore. It is an error to destroy a semaphore that has waiters.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_sem_destroy(uthread_sem_t* sem)
+{
+  // Enter critical section
+  enter_critical();
+
+  if (sem == nullptr || sem->waiters.head != nullptr)
+  {
+    ErrorLine() << "thread library error: semaphore is null or has waiters\n";
+    exit_critical();
+    return -1;
+  }
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Decrements the semaphore, parking the calling thread while its value is zero.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_sem_wait(uthread_sem_t* sem)
+{
+  // Enter critical section
+  enter_critical();
+
+  if (sem == nullptr)
+  {
+    ErrorLine() << "thread library error: semaphore is null\n";
+    exit_critical();
+    return -1;
+  }
+
+  // Take a unit, or wait until uthread_sem_post hands one to us
+  if (sem->value > 0)
+  {
+    sem->value--;
+  }
+  else
+  {
+    park(&sem->waiters);
+  }
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+/**
+ * @brief Decrements the semaphore if its value is positive, without blocking.
+ *
+ * @return 0 if the semaphore was decremented, 1 if its value is zero, -1 on error.
+ */
+int uthread_sem_trywait(uthread_sem_t* sem)
+{
+  // Enter critical section
+  enter_critical();
+
+  if (sem == nullptr)
+  {
+    ErrorLine() << "thread library error: semaphore is null\n";
+    exit_critical();
+    return -1;
+  }
+
+  int result = 1;
+  if (sem->value > 0)
+  {
+    sem->value--;
+    result = 0;
+  }
+
+  // Leave critical section
+  exit_critical();
+  return result;
+}
+
+/**
+ * @brief Increments the semaphore, or hands the unit directly to the first waiter if there is one.
+ *
+ * @return On success, return 0. On failure, return -1.
+ */
+int uthread_sem_post(uthread_sem_t* sem)
+{
+  // Enter critical section
+  enter_critical();
+
+  if (sem == nullptr)
+  {
+    ErrorLine() << "thread library error: semaphore is null\n";
+    exit_critical();
+    return -1;
+  }
+
+  if (wake_first(&sem->waiters) == nullptr)
+  {
+    sem->value++;
+  }
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+// Channel: ring buffer of pending messages plus the threads parked on either side
+struct uthread_chan
+{
+  void** buffer;
+  int capacity;
+  int head;                  // Index of the oldest buffered message
+  int count;
+  bool closed;
+  uthread_waitq_t senders;   // Parked senders, each holding its message in wait_msg
+  uthread_waitq_t receivers;
+};
+
+// Try to complete a send without blocking. Must be called inside a critical section.
+// Returns 0 if msg was delivered or buffered, 1 if the channel is full and -1 if it is closed.
+static int chan_send_now(uthread_chan_t* chan, void* msg)
+{
+  if (chan->closed) return -1;
+
+  // Hand the pointer straight to a parked receiver
+  TCB* receiver = wake_first(&chan->receivers);
+  if (receiver != nullptr)
+  {
+    receiver->wait_msg = msg;
+    receiver->wait_status = 0;
+    return 0;
+  }
 
-// Helper function to remove a thread from the ready queue
-void remove_from_ready_queue(int tid)
-{
-  std::queue<int> temp_queue;
-  while (!ready_queue.empty())
+  if (chan->count < chan->capacity)
   {
-    int id = ready_queue.front();
-    ready_queue.pop();
-    if (id != tid)
-    {
-      temp_queue.push(id);
-    }
+    chan->buffer[(chan->head + chan->count) % chan->capacity] = msg;
+    chan->count++;
+    return 0;
   }
-  ready_queue = temp_queue;
+  return 1;
 }
 
-// Scheduler handler function
-void scheduler_handler(int signum)
+// Try to complete a receive without blocking. Must be called inside a critical section.
+// Returns 0 if a message was stored in *msg, 1 if the channel is empty and -1 if it is closed and drained.
+static int chan_recv_now(uthread_chan_t* chan, void** msg)
 {
-  // Block signals during context switch to prevent nested signal handling
-  sigset_t mask;
-  sigemptyset(&mask);
-  sigaddset(&mask, SIGVTALRM);
-  sigprocmask(SIG_BLOCK, &mask, nullptr);
-
-  // Save the current thread's context
-  if (sigsetjmp(threads[current_tid]->env, 1) == 0)
+  if (chan->count > 0)
   {
-    // Context saved successfully, now handle scheduling
-
-    // Increment total quantum count
-    total_quantums++;
-
-    // Check if any sleeping threads need to wake up
-    for (auto it = blocked_set.begin(); it != blocked_set.end();)
-    {
-      int tid = *it;
-      if (threads[tid]->wake_time > 0 && threads[tid]->wake_time <= total_quantums)
-      {
-        threads[tid]->wake_time = -1; // Reset wake time
-        if (!threads[tid]->explicitly_blocked)
-        {
-          threads[tid]->state = READY;
-          ready_queue.push(tid);
-          it = blocked_set.erase(it); // Remove from blocked set
-        }
-      }
-      else
-      {
-        ++it;
-      }
-    }
-    // If current thread is still in RUNNING state, move to READY
-    if (threads[current_tid]->state == RUNNING)
-    {
-      threads[current_tid]->state = READY;
-      ready_queue.push(current_tid);
-    }
+    *msg = chan->buffer[chan->head];
+    chan->head = (chan->head + 1) % chan->capacity;
+    chan->count--;
 
-    // Select next thread to run
-    if (ready_queue.empty())
+    // The slot we freed goes to the longest-waiting sender
+    TCB* sender = wake_first(&chan->senders);
+    if (sender != nullptr)
     {
-      std::cerr << "thread library error: no threads to schedule\n";
-      exit(1); // No threads are ready to run
+      chan->buffer[(chan->head + chan->count) % chan->capacity] = sender->wait_msg;
+      chan->count++;
+      sender->wait_status = 0;
     }
+    return 0;
+  }
 
-    // Get next thread from queue
-    int next_tid = ready_queue.front();
-    ready_queue.pop();
-
-    // Update state and quantum count for the next thread
-    current_tid = next_tid;
-    threads[current_tid]->state = RUNNING;
-    threads[current_tid]->quantums++;
+  // Unbuffered, or a sender got parked while the buffer was full: take its message directly
+  TCB* sender = wake_first(&chan->senders);
+  if (sender != nullptr)
+  {
+    *msg = sender->wait_msg;
+    sender->wait_status = 0;
+    return 0;
+  }
 
-    // Unblock signals before switching context
-    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+  return chan->closed ? -1 : 1;
+}
 
-    // Switch to the selected thread
-    siglongjmp(threads[current_tid]->env, 1);
+/**
+ * @brief Creates a channel that buffers up to capacity messages.
+ *
+ * With capacity 0 every send waits for a matching receive (rendezvous).
+ *
+ * @return On success, return the new channel. On failure, return NULL.
+ */
+uthread_chan_t* uthread_chan_create(int capacity)
+{
+  if (capacity < 0)
+  {
+    ErrorLine() << "thread library error: channel capacity must be non-negative\n";
+    return nullptr;
   }
 
-  // If we get here, we're returning from a context switch (siglongjmp)
-  // Just unblock signals and continue execution
-  sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+  uthread_chan_t* chan = new uthread_chan_t();
+  chan->buffer = capacity > 0 ? new void*[capacity] : nullptr;
+  chan->capacity = capacity;
+  return chan;
 }
 
 /**
- * @brief initializes the thread library.
- * @brief initializes the thread library.
- *
- * Once this function returns, the main thread (tid == 0) will be set as RUNNING. There is no need to
- * provide an entry_point or to create a stack for the main thread - it will be using the "regular" stack and PC.
- * You may assume that this function is called before any other thread library function, and that it is called
- * exactly once.
- * The input to the function is the length of a quantum in micro-seconds.
- * It is an error to call this function with non-positive quantum_usecs.
+ * @brief Destroys a channel and its buffer. It is an error to destroy a channel that has parked threads.
  *
  * @return On success, return 0. On failure, return -1.
  */
-int uthread_init(int quantum_usecs)
+int uthread_chan_destroy(uthread_chan_t* chan)
 {
-  // Block signals during critical section
-  sigset_t mask;
-  sigemptyset(&mask);
-  sigaddset(&mask, SIGVTALRM);
-  sigprocmask(SIG_BLOCK, &mask, nullptr);
+  // Enter critical section
+  enter_critical();
 
-  // 1. validate the input
-  if (quantum_usecs <= 0)
+  if (chan == nullptr || chan->senders.head != nullptr || chan->receivers.head != nullptr)
   {
-    std::cerr << "thread library error: quantum_usecs must be positive\n";
-    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+    ErrorLine() << "thread library error: channel is null or has waiting threads\n";
+    exit_critical();
     return -1;
   }
 
-  // 2. Allocate memory for all stacks at once
-  g_stack_memory = new char[MAX_THREAD_NUM * STACK_SIZE];
-  g_stack_in_use = new bool[MAX_THREAD_NUM]();  // Initialize all to false
+  delete[] chan->buffer;
+  delete chan;
 
-  // Register cleanup handler
-  std::atexit([]() {
-      // Free thread control blocks
-      for (auto& pair : threads)
-      {
-        delete pair.second;
-      }
-      threads.clear();
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
 
-      // Free stack memory
-      delete[] g_stack_memory;
-      delete[] g_stack_in_use;
-  });
+/**
+ * @brief Sends msg, parking the calling thread while the channel is full.
+ *
+ * @return On success, return 0. If the channel is or gets closed before msg is taken, return -1.
+ */
+int uthread_chan_send(uthread_chan_t* chan, void* msg)
+{
+  // Enter critical section
+  enter_critical();
 
-  // 2. Install scheduler SIGVTALRM handler
-  struct sigaction sa = {0}; // Declare and initialize sa
-  sa.sa_handler = scheduler_handler;
-  sigemptyset(&sa.sa_mask);
-  sa.sa_flags = SA_RESTART;
-  if (sigaction(SIGVTALRM, &sa, nullptr) < 0)
+  if (chan == nullptr)
   {
-    perror("system error: sigaction");
-    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
-    exit(1);
+    ErrorLine() << "thread library error: channel is null\n";
+    exit_critical();
+    return -1;
   }
 
-  // 3. Set up the timer
-  struct itimerval timer;
-  timer.it_interval.tv_sec = quantum_usecs / 1000000;
-  timer.it_interval.tv_usec = quantum_usecs % 1000000;
-  timer.it_value = timer.it_interval;
-
-  if (setitimer(ITIMER_VIRTUAL, &timer, nullptr) < 0)
+  // Deliver or buffer the message, or park until a receiver takes it or the channel is closed
+  int result = chan_send_now(chan, msg);
+  if (result == 1)
   {
-    perror("system error: setitimer");
-    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
-    exit(1);
+    TCB* self = tcb(current_tid);
+    self->wait_msg = msg;
+    park(&chan->senders);
+    result = self->wait_status;
   }
 
-  // 4. Create and register the main thread TCB
-  TCB* main_t = new TCB(0); // Changed from unique_ptr
-  main_t->state = RUNNING;
-  main_t->quantums = 1;
-  threads[0] = main_t; // Store pointer directly
-  current_tid = 0;
-  total_quantums = 1;
-
-  sigprocmask(SIG_UNBLOCK, &mask, nullptr);
-  return 0;
+  // Leave critical section
+  exit_critical();
+  return result;
 }
 
 /**
- * @brief Creates a new thread, whose entry point is the function entry_point with the signature
- * void entry_point(void).
+ * @brief Receives the oldest message into *msg, parking the calling thread while the channel is empty.
  *
- * The thread is added to the end of the READY threads list.
- * The uthread_spawn function should fail if it would cause the number of concurrent threads to exceed the
- * limit (MAX_THREAD_NUM).
- * Each thread should be allocated with a stack of size STACK_SIZE bytes.
- * It is an error to call this function with a null entry_point.
- *
- * @return On success, return the ID of the created thread. On failure, return -1.
+ * @return On success, return 0. If the channel is closed and drained, return -1.
  */
-int uthread_spawn(thread_entry_point entry_point)
+int uthread_chan_recv(uthread_chan_t* chan, void** msg)
 {
-  // Block signals during critical section
-  sigset_t mask;
-  sigemptyset(&mask);
-  sigaddset(&mask, SIGVTALRM);
-  sigprocmask(SIG_BLOCK, &mask, nullptr);
+  // Enter critical section
+  enter_critical();
 
-  // 1. validate the input
-  if (entry_point == nullptr)
+  if (chan == nullptr || msg == nullptr)
   {
-    std::cerr << "thread library error: entry_point is null\n";
-    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+    ErrorLine() << "thread library error: channel or message pointer is null\n";
+    exit_critical();
     return -1;
   }
 
-  if (threads.size() >= MAX_THREAD_NUM)
+  // Take a message, or park until a sender hands one over or the channel is closed
+  int result = chan_recv_now(chan, msg);
+  if (result == 1)
   {
-    std::cerr << "thread library error: too many threads\n";
-    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
-    return -1;
+    TCB* self = tcb(current_tid);
+    park(&chan->receivers);
+    *msg = self->wait_msg;
+    result = self->wait_status;
   }
 
-  // 2. get smallest available thread ID
-  int tid = 1;
-  while (threads.count(tid) > 0)
-  {
-    ++tid;
-    if (tid >= MAX_THREAD_NUM)
-    {
-      std::cerr << "thread library error: no available thread ID\n";
-      sigprocmask(SIG_UNBLOCK, &mask, nullptr);
-      return -1;
-    }
-  }
+  // Leave critical section
+  exit_critical();
+  return result;
+}
 
-  // 3. Find an available stack slot
-  int stack_index = -1;
-  for (int i = 0; i < MAX_THREAD_NUM; i++) {
-    if (!g_stack_in_use[i]) {
-      stack_index = i;
-      g_stack_in_use[i] = true;
-      break;
-    }
-  }
+/**
+ * @brief Sends msg if that can be done without blocking.
+ *
+ * @return 0 if msg was sent, 1 if the channel is full, -1 if it is closed or on error.
+ */
+int uthread_chan_try_send(uthread_chan_t* chan, void* msg)
+{
+  // Enter critical section
+  enter_critical();
 
-  if (stack_index == -1) {
-    std::cerr << "thread library error: no stack slots available\n";
-    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+  if (chan == nullptr)
+  {
+    ErrorLine() << "thread library error: channel is null\n";
+    exit_critical();
     return -1;
   }
 
-  // 4. Allocate and initialize TCB
-  TCB* new_t = new TCB(tid);
-  new_t->stack = &g_stack_memory[stack_index * STACK_SIZE];
-  new_t->stack_index = stack_index;
-
-  // 5. Get temporary context
-  if (sigsetjmp(new_t->env, 1) == 0)
-  {
-    // Continue setup
-  }
-  else
-  {
-    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
-    entry_point();
-    uthread_terminate(tid);
-  }
+  int result = chan_send_now(chan, msg);
 
-  // 6. Set up stack and context
-  address_t sp = (address_t)new_t->stack + STACK_SIZE - sizeof(address_t);
+  // Leave critical section
+  exit_critical();
+  return result;
+}
 
-  // Patch the jmpbuf slots
-  new_t->env->__jmpbuf[JB_SP] = translate_address(sp);
-  new_t->env->__jmpbuf[JB_PC] = translate_address((address_t)entry_point);
+/**
+ * @brief Receives a message into *msg if one is available without blocking.
+ *
+ * @return 0 if a message was received, 1 if the channel is empty, -1 if it is closed and drained or on error.
+ */
+int uthread_chan_try_recv(uthread_chan_t* chan, void** msg)
+{
+  // Enter critical section
+  enter_critical();
 
-  // Clear signal mask
-  sigemptyset(&new_t->env->__saved_mask);
+  if (chan == nullptr || msg == nullptr)
+  {
+    ErrorLine() << "thread library error: channel or message pointer is null\n";
+    exit_critical();
+    return -1;
+  }
 
-  // 7. Store in map and enqueue
-  threads[tid] = new_t; // Store pointer directly
-  threads[tid]->state = READY;
-  ready_queue.push(tid);
+  int result = chan_recv_now(chan, msg);
 
-  // Unblock signals
-  sigprocmask(SIG_UNBLOCK, &mask, nullptr);
-  return tid;
+  // Leave critical section
+  exit_critical();
+  return result;
 }
 
 /**
- * @brief Terminates the thread with ID tid and deletes it from all relevant control structures.
+ * @brief Closes a channel. Further sends fail; parked senders and receivers are woken and fail.
  *
- * All the resources allocated by the library for this thread should be released. If no thread with ID tid exists it
- * is considered an error. Terminating the main thread (tid == 0) will result in the termination of the entire
- * process using exit(0) (after releasing the assigned library memory).
+ * It is an error to close a channel twice.
  *
- * @return The function returns 0 if the thread was successfully terminated and -1 otherwise. If a thread terminates
- * itself or the main thread is terminated, the function does not return.
+ * @return On success, return 0. On failure, return -1.
  */
-int uthread_terminate(int tid)
+int uthread_chan_close(uthread_chan_t* chan)
 {
-  // Block signals during critical section
-  sigset_t mask;
-  sigemptyset(&mask);
-  sigaddset(&mask, SIGVTALRM);
-  sigprocmask(SIG_BLOCK, &mask, nullptr);
+  // Enter critical section
+  enter_critical();
 
-  // 1. Find the thread in our map
-  auto it = threads.find(tid);
-  if (it == threads.end())
+  if (chan == nullptr || chan->closed)
   {
-    std::cerr << "thread library error: thread ID " << tid << " does not exist\n";
-    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+    ErrorLine() << "thread library error: channel is null or already closed\n";
+    exit_critical();
     return -1;
   }
 
-  // 2. If it's the main thread, clean up everything and exit
-  if (tid == 0)
+  // Fail every parked operation
+  chan->closed = true;
+  TCB* t;
+  while ((t = wake_first(&chan->receivers)) != nullptr)
   {
-    // Free all threads when main terminates
-    for (auto& pair : threads)
-    {
-      delete pair.second; // Manually delete all TCBs
-    }
-    threads.clear();
-    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
-    exit(0);
+    t->wait_msg = nullptr;
+    t->wait_status = -1;
   }
-
-  // 3. Terminating another thread
-  if (tid != current_tid)
+  while ((t = wake_first(&chan->senders)) != nullptr)
   {
-    TCB* t = it->second;
+    t->wait_status = -1;
+  }
+
+  // Leave critical section
+  exit_critical();
+  return 0;
+}
+
+// A queued pool task
+struct PoolTask
+{
+  thread_arg_entry_point fn;
+  void* arg;
+};
+
+struct uthread_pool
+{
+  PoolTask* tasks;           // Ring of queued tasks; its capacity is a power of two and doubles when it fills up
+  int capacity;
+  int head;                  // Index of the oldest queued task
+  int count;
+  bool closing;              // uthread_pool_destroy was called: workers return once the queue is drained
+  int* workers;              // Worker tids
+  int nworkers;
+  uthread_waitq_t idle;      // Workers parked with nothing to run
+};
+
+// Body of every pool worker: run queued tasks and park while there are none, until the pool is closed and drained
+static void pool_worker(void* arg)
+{
+  uthread_pool_t* pool = (uthread_pool_t*)arg;
 
-    // a) If it was READY, remove from the ready queue
-    if (t->state == READY)
+  enter_critical();
+  for (;;)
+  {
+    if (pool->count > 0)
+    {
+      PoolTask task = pool->tasks[pool->head];
+      pool->head = (pool->head + 1) & (pool->capacity - 1);
+      pool->count--;
+      exit_critical();
+      task.fn(task.arg);
+      enter_critical();
+    }
+    else if (pool->closing)
     {
-      remove_from_ready_queue(tid);
+      break;
     }
-      // b) If it was blocked, remove from the blocked set
-    else if (t->state == BLOCKED)
+    else
     {
-      blocked_set.erase(tid);
+      park(&pool->idle);
     }
+  }
+  exit_critical();
+}
 
-    // c) Erase the TCB and free memory
-    threads.erase(it);
-    g_stack_in_use[t->stack_index] = false; // Mark stack as free
-    delete t; // Manually delete the TCB
+// Whether the calling thread is one of pool's workers
+static bool in_pool(uthread_pool_t* pool)
+{
+  for (int i = 0; i < pool->nworkers; i++)
+  {
+    if (pool->workers[i] == current_tid) return true;
+  }
+  return false;
+}
 
-    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
-    return 0;
+/**
+ * @brief Creates a pool of nthreads worker threads, which count against the thread limit like any other thread.
+ *
+ * @return On success, return the new pool. On failure, return NULL.
+ */
+uthread_pool_t* uthread_pool_create(int nthreads)
+{
+  if (nthreads < 1)
+  {
+    ErrorLine() << "thread library error: a pool needs at least one thread\n";
+    return nullptr;
   }
 
-  // 4. Terminating self (tid == current_tid)
-  //    We must pick a new thread and jump into it before freeing our TCB.
+  uthread_pool_t* pool = new uthread_pool_t();
+  pool->capacity = 64;
+  pool->tasks = new PoolTask[pool->capacity];
+  pool->workers = new int[nthreads];
 
-  // a) If no other thread is ready, just exit
-  if (ready_queue.empty())
+  // The workers are joinable, so that uthread_pool_destroy can wait for them to finish the queue
+  uthread_attr_t attr = {};
+  attr.joinable = 1;
+  for (int i = 0; i < nthreads; i++)
   {
-    // Free all threads and exit
-    TCB* self = it->second;
-    threads.erase(it);
-    delete self;
-
-    for (auto& pair : threads)
+    int tid = spawn(nullptr, pool_worker, pool, &attr);
+    if (tid < 0)
     {
-      delete pair.second;
+      // Take back the workers spawned so far
+      for (int j = 0; j < i; j++)
+      {
+        uthread_detach(pool->workers[j]);
+        uthread_terminate(pool->workers[j]);
+      }
+      delete[] pool->workers;
+      delete[] pool->tasks;
+      delete pool;
+      return nullptr;
     }
-    threads.clear();
-
-    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
-    exit(0);
+    pool->workers[i] = tid;
   }
-
-  total_quantums++; // Increment total quantums
-
-  // b) Dequeue the next thread
-  int next_tid = ready_queue.front();
-  ready_queue.pop();
-
-  // IMPORTANT: Save context BEFORE deleting current thread
-  jmp_buf next_env;
-  memcpy(next_env, threads[next_tid]->env, sizeof(jmp_buf));
-
-  // c) Switch state
-  threads[next_tid]->state = RUNNING;
-  threads[next_tid]->quantums++;
-
-  // Store current TCB to delete after updating current_tid
-  TCB* self = it->second;
-  current_tid = next_tid;
-
-  // Remove from threads map
-  threads.erase(it);
-  g_stack_in_use[self->stack_index] = false; // Mark stack as free
-
-  // d) Unblock signals, delete self, and jump to next thread
-  sigprocmask(SIG_UNBLOCK, &mask, nullptr);
-  delete self; // Free memory AFTER we're done with it
-  siglongjmp(next_env, 1);
-
-  // Unreachable
-  return 0;
+  pool->nworkers = nthreads;
+  return pool;
 }
 
 /**
- * @brief Blocks the thread with ID tid. The thread may be resumed later using uthread_resume.
+ * @brief Queues the task fn(arg) on pool. The next idle worker runs it; the caller never blocks.
  *
- * If no thread with ID tid exists it is considered as an error. In addition, it is an error to try blocking the
- * main thread (tid == 0). If a thread blocks itself, a scheduling decision should be made. Blocking a thread in
- * BLOCKED state has no effect and is not considered an error.
+ * It is an error to submit to a pool that is being destroyed, except from one of its own tasks.
  *
  * @return On success, return 0. On failure, return -1.
  */
-int uthread_block(int tid)
+int uthread_pool_submit(uthread_pool_t* pool, thread_arg_entry_point fn, void* arg)
 {
-  // Block signals during critical section
-  sigset_t mask;
-  sigemptyset(&mask);
-  sigaddset(&mask, SIGVTALRM);
-  sigprocmask(SIG_BLOCK, &mask, nullptr);
+  // Enter critical section
+  enter_critical();
 
-  // 1. validate the input
-  if (tid == 0 || threads.find(tid) == threads.end())
+  if (pool == nullptr || fn == nullptr || (pool->closing && !in_pool(pool)))
   {
-    std::cerr << "thread library error: invalid thread ID " << tid << "\n";
-    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+    ErrorLine() << "thread library error: pool or task is null, or the pool is being destroyed\n";
+    exit_critical();
     return -1;
   }
 
-  threads[tid]->explicitly_blocked = true; // Mark as explicitly blocked
-
-  // 2. Check if already blocked
-  if (threads[tid]->state == BLOCKED)
-  {
-    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
-    return 0; // No effect, already blocked
-  }
-
-  // If in READY state, remove from ready queue
-  if (threads[tid]->state == READY)
+  // Unroll a full ring into one twice the size
+  if (pool->count == pool->capacity)
   {
-    remove_from_ready_queue(tid);
+    PoolTask* tasks = new PoolTask[2 * pool->capacity];
+    for (int i = 0; i < pool->count; i++)
+    {
+      tasks[i] = pool->tasks[(pool->head + i) & (pool->capacity - 1)];
+    }
+    delete[] pool->tasks;
+    pool->tasks = tasks;
+    pool->capacity *= 2;
+    pool->head = 0;
   }
+  pool->tasks[(pool->head + pool->count) & (pool->capacity - 1)] = {fn, arg};
+  pool->count++;
 
-  // 3. Block the thread and update state
-  threads[tid]->state = BLOCKED;
-  blocked_set.insert(tid);
+  // Hand the task to an idle worker, if there is one; a busy worker takes it when it finishes its current task
+  wake_first(&pool->idle);
 
-  // 4. If blocking self, schedule next thread
-  if (tid == current_tid)
-  {
-    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
-    scheduler_handler(SIGVTALRM);
-  }
-  // Unblock signals
-  sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+  // Leave critical section
+  exit_critical();
   return 0;
 }
 
 /**
- * @brief Resumes a blocked thread with ID tid and moves it to the READY state.
+ * @brief Runs every task still queued on pool, then ends its workers and frees it.
  *
- * Resuming a thread in a RUNNING or READY state has no effect and is not considered as an error. If no thread with
- * ID tid exists it is considered an error.
+ * The caller is BLOCKED until the last worker has terminated. It is an error to destroy a pool from one of its own
+ * tasks.
  *
  * @return On success, return 0. On failure, return -1.
  */
-int uthread_resume(int tid)
+int uthread_pool_destroy(uthread_pool_t* pool)
 {
-  // Block signals during critical section
-  sigset_t mask;
-  sigemptyset(&mask);
-  sigaddset(&mask, SIGVTALRM);
-  sigprocmask(SIG_BLOCK, &mask, nullptr);
+  // Enter critical section
+  enter_critical();
 
-  // 1. validate the input
-  if (threads.find(tid) == threads.end())
+  if (pool == nullptr || pool->closing || in_pool(pool))
   {
-    std::cerr << "thread library error: invalid thread ID " << tid << "\n";
-    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+    ErrorLine() << "thread library error: pool is null, already being destroyed, or destroyed from its own task\n";
+    exit_critical();
     return -1;
   }
 
-  // 2. Check if already in READY state
-  if (threads[tid]->state == READY)
+  // Let every worker drain the queue and return
+  pool->closing = true;
+  while (wake_first(&pool->idle) != nullptr)
   {
-    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
-    return 0; // No effect, already in READY state
   }
 
-  threads[tid]->explicitly_blocked = false; // Reset explicitly blocked flag
-
-  // 3. Check if not sleeping
-  if (threads[tid]->state == BLOCKED && threads[tid]->wake_time < 0)
-  {
-    threads[tid]->state = READY;
-    ready_queue.push(tid);
-    blocked_set.erase(tid); // Remove from blocked set
-    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
-    return 0; // No effect, already in READY state
-  }
+  // Leave critical section
+  exit_critical();
 
-  // 4. If resuming self, schedule next thread
-  if (tid == current_tid)
+  for (int i = 0; i < pool->nworkers; i++)
   {
-    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
-    scheduler_handler(SIGVTALRM);
+    uthread_join(pool->workers[i], nullptr);
   }
-
-  // Unblock signals
-  sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+  delete[] pool->workers;
+  delete[] pool->tasks;
+  delete pool;
   return 0;
 }
 
 /**
- * @brief Blocks the RUNNING thread for num_quantums quantums.
- *
- * Immediately after the RUNNING thread transitions to the BLOCKED state a scheduling decision should be made.
- * After the sleeping time is over, the thread should go back to the end of the READY queue.
- * If the thread which was just RUNNING should also be added to the READY queue, or if multiple threads wake up
- * at the same time, the order in which they're added to the end of the READY queue doesn't matter.
- * The number of quantums refers to the number of times a new quantum starts, regardless of the reason. Specifically,
- * the quantum of the thread which has made the call to uthread_sleep isn’t counted.
- * It is considered an error if the main thread (tid == 0) calls this function.
+ * @brief Reads up to count bytes from fd into buf, parking the calling thread until data is available.
  *
- * @return On success, return 0. On failure, return -1.
+ * @return The number of bytes read (0 at end of file), or -1 with errno set.
  */
-int uthread_sleep(int num_quantums)
+ssize_t uthread_read(int fd, void* buf, size_t count)
 {
-  // Block signals during critical section
-  sigset_t mask;
-  sigemptyset(&mask);
-  sigaddset(&mask, SIGVTALRM);
-  sigprocmask(SIG_BLOCK, &mask, nullptr);
-
-  // 1. validate the input
-  if (num_quantums <= 0 || current_tid == 0)
+  for (;;)
   {
-    std::cerr << "thread library error: invalid sleep time or main thread\n";
-    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
-    return -1;
-  }
-
-  // 2. Block the RUNNING thread
-  threads[current_tid]->state = BLOCKED;
-  threads[current_tid]->wake_time = total_quantums + num_quantums + 1;
-  blocked_set.insert(current_tid);
-
-  // 3. Schedule next thread
-  scheduler_handler(SIGVTALRM);
+    ssize_t n = read(fd, buf, count);
+    if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) return n;
+    if (errno == EINTR) continue;
 
-  // Unblock signals
-  sigprocmask(SIG_UNBLOCK, &mask, nullptr);
-  return 0;
+    enter_critical();
+    int result = wait_fd(fd, EPOLLIN);
+    exit_critical();
+    if (result < 0) return -1;
+  }
 }
 
 /**
- * @brief Returns the thread ID of the calling thread.
+ * @brief Writes up to count bytes from buf to fd, parking the calling thread until fd accepts data.
  *
- * @return The ID of the calling thread.
+ * @return The number of bytes written, or -1 with errno set.
  */
-int uthread_get_tid()
+ssize_t uthread_write(int fd, const void* buf, size_t count)
 {
-  // Block signals during critical section
-  sigset_t mask;
-  sigemptyset(&mask);
-  sigaddset(&mask, SIGVTALRM);
-  sigprocmask(SIG_BLOCK, &mask, nullptr);
-  int result = current_tid;
-  // Unblock signals
-  sigprocmask(SIG_UNBLOCK, &mask, nullptr);
-  return result;
+  for (;;)
+  {
+    ssize_t n = write(fd, buf, count);
+    if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) return n;
+    if (errno == EINTR) continue;
+
+    enter_critical();
+    int result = wait_fd(fd, EPOLLOUT);
+    exit_critical();
+    if (result < 0) return -1;
+  }
 }
 
 /**
- * @brief Returns the total number of quantums since the library was initialized, including the current quantum.
+ * @brief Accepts a connection on the listening socket sockfd, parking the calling thread until one arrives.
  *
- * Right after the call to uthread_init, the value should be 1.
- * Each time a new quantum starts, regardless of the reason, this number should be increased by 1.
+ * The returned socket is already in non-blocking mode and close-on-exec.
  *
- * @return The total number of quantums.
+ * @return The new socket, or -1 with errno set.
  */
-int uthread_get_total_quantums()
+int uthread_accept(int sockfd, struct sockaddr* addr, socklen_t* addrlen)
 {
-  // Block signals during critical section
-  sigset_t mask;
-  sigemptyset(&mask);
-  sigaddset(&mask, SIGVTALRM);
-  sigprocmask(SIG_BLOCK, &mask, nullptr);
-  int result = total_quantums;
-  // Unblock signals
-  sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+  for (;;)
+  {
+    int fd = accept4(sockfd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) return fd;
+    if (errno == EINTR) continue;
 
-  return result;
+    enter_critical();
+    int result = wait_fd(sockfd, EPOLLIN);
+    exit_critical();
+    if (result < 0) return -1;
+  }
 }
 
 /**
- * @brief Returns the number of quantums the thread with ID tid was in RUNNING state.
- *
- * On the first time a thread runs, the function should return 1. Every additional quantum that the thread starts should
- * increase this value by 1 (so if the thread with ID tid is in RUNNING state when this function is called, include
- * also the current quantum). If no thread with ID tid exists it is considered an error.
+ * @brief Connects the socket sockfd to addr, parking the calling thread until the connection is established.
  *
- * @return On success, return the number of quantums of the thread with ID tid. On failure, return -1.
+ * @return On success, return 0. On failure, return -1 with errno set.
  */
-int uthread_get_quantums(int tid)
+int uthread_connect(int sockfd, const struct sockaddr* addr, socklen_t addrlen)
 {
-  // Block signals during critical section
-  sigset_t mask;
-  sigemptyset(&mask);
-  sigaddset(&mask, SIGVTALRM);
-  sigprocmask(SIG_BLOCK, &mask, nullptr);
+  if (connect(sockfd, addr, addrlen) == 0) return 0;
+  if (errno != EINPROGRESS && errno != EINTR) return -1;
 
-  if (threads.find(tid) == threads.end())
+  // The connection completes in the background; wait until the socket turns writable and fetch the outcome
+  enter_critical();
+  int result = wait_fd(sockfd, EPOLLOUT);
+  exit_critical();
+  if (result < 0) return -1;
+
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) return -1;
+  if (error != 0)
   {
-    std::cerr << "thread library error: invalid thread ID " << tid << "\n";
-    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+    errno = error;
     return -1;
   }
-
-  int result = threads[tid]->quantums;
-
-  // Unblock signals
-  sigprocmask(SIG_UNBLOCK, &mask, nullptr);
-
-  return result;
+  return 0;
 }
\ No newline at end of file
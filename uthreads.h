@@ -6,11 +6,165 @@
 #ifndef _UTHREADS_H
 #define _UTHREADS_H
 
+#include <sys/types.h>
+#include <sys/socket.h>
 
-#define MAX_THREAD_NUM 100 /* maximal number of threads */
+#define MAX_THREAD_NUM 100 /* default limit on concurrent threads, see uthread_set_thread_limit */
+#define UTHREAD_THREAD_LIMIT_MAX (1 << 20) /* largest limit uthread_set_thread_limit accepts */
+#define UTHREAD_PRIO_LEVELS 8 /* priorities run from 0 (highest, the default) to UTHREAD_PRIO_LEVELS - 1 */
+#define UTHREAD_WEIGHT_DEFAULT 1024 /* CPU share weight of a thread under the proportional-share policies */
+#define UTHREAD_WEIGHT_MAX (1 << 20)
 #define STACK_SIZE 4096 /* stack size per thread (in bytes) */
+#define UTHREAD_HIST_BUCKETS 32 /* buckets of the latency histograms in uthread_global_stats_t */
+#define UTHREAD_WORKERS_MAX 256 /* most kernel threads uthread_init_ex can run uthreads on */
 
 typedef void (*thread_entry_point)(void);
+typedef void (*thread_arg_entry_point)(void* arg);
+
+/* Clock that measures quanta and drives preemption (see uthread_init_ex) */
+typedef enum
+{
+    UTHREAD_CLOCK_VIRTUAL = 0,   /* setitimer(ITIMER_VIRTUAL): user CPU time of the process, SIGVTALRM (default) */
+    UTHREAD_CLOCK_REAL,          /* setitimer(ITIMER_REAL): wall-clock time, SIGALRM */
+    UTHREAD_CLOCK_MONOTONIC,     /* timer_create(CLOCK_MONOTONIC): wall-clock time, SIGVTALRM */
+    UTHREAD_CLOCK_PROCESS_CPU    /* timer_create(CLOCK_PROCESS_CPUTIME_ID): user+system CPU time, SIGVTALRM */
+} uthread_clock_t;
+
+/* Scheduling policy (see uthread_init_ex) */
+typedef enum
+{
+    UTHREAD_SCHED_RR = 0,   /* round robin among the READY threads of the highest non-empty priority (default) */
+    UTHREAD_SCHED_MLFQ,     /* multi-level feedback queue: a thread's level drops as it uses up whole quanta */
+    UTHREAD_SCHED_STRIDE,   /* stride scheduling: quanta shared in proportion to thread weights */
+    UTHREAD_SCHED_CFS       /* virtual runtime in nanoseconds scaled by weight; least-served thread runs next */
+} uthread_sched_t;
+
+/* Library configuration for uthread_init_ex. A zero-initialized struct selects the defaults of uthread_init. */
+typedef struct
+{
+    uthread_clock_t clock;
+    uthread_sched_t sched;
+    int mlfq_boost_quanta;   /* MLFQ: quanta between boosts of every thread back to its priority; 0 means 100 */
+    int tickless;            /* non-zero: stop the timer while no other thread is READY */
+    int adaptive_quantum;    /* if > 1, a CPU-bound thread may run up to this many quanta per turn */
+    int workers;             /* if > 1, kernel threads that run the uthreads (M:N mode); 0 or 1 runs them all on the
+                                calling thread */
+} uthread_init_attr_t;
+
+/* Per-thread attributes for uthread_spawn_ex. A zero-initialized struct selects the defaults of uthread_spawn. */
+typedef struct
+{
+    size_t stack_size;   /* stack bytes for the thread's own frames; 0 means STACK_SIZE. The library adds room for
+                            the signal frame and scheduler frames of a preemption and rounds up to whole pages. */
+    int priority;        /* initial priority, see uthread_set_priority */
+    int weight;          /* initial weight, see uthread_set_weight; 0 means UTHREAD_WEIGHT_DEFAULT */
+    int joinable;        /* non-zero: the thread's tid and exit value outlive it until uthread_join, see there */
+} uthread_attr_t;
+
+/* Scheduler statistics of one thread (uthread_get_stats). Times are in nanoseconds of wall-clock time. */
+typedef struct
+{
+    unsigned long long cpu_ns;                 /* time spent RUNNING */
+    unsigned long long ready_ns;               /* time spent READY waiting for the CPU (run-queue latency) */
+    unsigned long long voluntary_switches;     /* switched out because it blocked, slept, waited or yielded */
+    unsigned long long involuntary_switches;   /* switched out while still runnable: preempted or out of EDF budget */
+    unsigned long long sleeps;                 /* uthread_sleep calls that have returned */
+    unsigned long long sleep_overshoot_ns;     /* how much longer than requested those sleeps took in total */
+} uthread_stats_t;
+
+/* Library-wide scheduler statistics (uthread_get_global_stats). Histogram bucket i counts the events that took
+   [2^i, 2^(i+1)) nanoseconds; the last bucket also counts everything longer. */
+typedef struct
+{
+    uthread_stats_t total;                                 /* sums over all threads, terminated ones included */
+    unsigned long long idle_ns;                            /* time with no thread READY */
+    unsigned long long switch_hist[UTHREAD_HIST_BUCKETS];  /* from a thread leaving the CPU to the next one running */
+    unsigned long long wakeup_hist[UTHREAD_HIST_BUCKETS];  /* from a BLOCKED thread becoming READY to it running */
+} uthread_global_stats_t;
+
+/* Scheduling events recorded by the trace buffer (uthread_trace_start). The thread that caused a SPAWN, WAKE, BLOCK,
+   RESUME or TERMINATE event is the one that was switched in last before it. */
+typedef enum
+{
+    UTHREAD_TRACE_SPAWN = 1,    /* tid was created */
+    UTHREAD_TRACE_SWITCH_IN,    /* tid started running */
+    UTHREAD_TRACE_SWITCH_OUT,   /* tid left the CPU; reason says why */
+    UTHREAD_TRACE_WAKE,         /* tid became READY after being BLOCKED */
+    UTHREAD_TRACE_BLOCK,        /* uthread_block(tid) */
+    UTHREAD_TRACE_RESUME,       /* uthread_resume(tid) */
+    UTHREAD_TRACE_TERMINATE     /* tid was terminated */
+} uthread_trace_type_t;
+
+/* Why a thread left the CPU (UTHREAD_TRACE_SWITCH_OUT) */
+typedef enum
+{
+    UTHREAD_TRACE_PREEMPT = 0,  /* quantum expired, a thread that outranks it woke, or it ran out of EDF budget */
+    UTHREAD_TRACE_BLOCKED,      /* uthread_block */
+    UTHREAD_TRACE_SLEEP,        /* uthread_sleep or uthread_wait_next_period */
+    UTHREAD_TRACE_WAIT,         /* mutex, condition variable, semaphore, channel or file descriptor */
+    UTHREAD_TRACE_EXIT,         /* uthread_terminate */
+    UTHREAD_TRACE_YIELD         /* uthread_yield or uthread_yield_to */
+} uthread_trace_reason_t;
+
+/* One trace event as written by uthread_trace_dump */
+typedef struct
+{
+    unsigned long long ns;      /* nanoseconds since uthread_init */
+    int tid;
+    unsigned char type;         /* uthread_trace_type_t */
+    unsigned char reason;       /* uthread_trace_reason_t for SWITCH_OUT, otherwise 0 */
+    unsigned short reserved;
+} uthread_trace_event_t;
+
+/* Start of a dump written by uthread_trace_dump; count events follow it, oldest first */
+typedef struct
+{
+    char magic[8];                  /* UTHREAD_TRACE_MAGIC, not NUL-terminated */
+    unsigned int version;           /* UTHREAD_TRACE_VERSION */
+    unsigned int event_size;        /* sizeof(uthread_trace_event_t) */
+    unsigned long long count;
+    unsigned long long dropped;     /* older events overwritten because the ring was full */
+} uthread_trace_header_t;
+
+#define UTHREAD_TRACE_MAGIC "UTTRACE\n"
+#define UTHREAD_TRACE_VERSION 1
+
+/* FIFO queue of threads parked on a synchronization object. Managed by the library; zero-initialized is empty. */
+typedef struct uthread_waitq
+{
+    void* head;
+    void* tail;
+} uthread_waitq_t;
+
+/* Blocking mutex. Zero-initialized (or UTHREAD_MUTEX_INITIALIZER) is unlocked. */
+typedef struct
+{
+    int locked;
+    int owner;              /* tid of the holder while locked */
+    uthread_waitq_t waiters;
+} uthread_mutex_t;
+
+/* Condition variable. Zero-initialized (or UTHREAD_COND_INITIALIZER) has no waiters. */
+typedef struct
+{
+    uthread_waitq_t waiters;
+} uthread_cond_t;
+
+/* Counting semaphore. */
+typedef struct
+{
+    int value;
+    uthread_waitq_t waiters;
+} uthread_sem_t;
+
+/* Bounded channel carrying pointers between threads. Opaque; see uthread_chan_create. */
+typedef struct uthread_chan uthread_chan_t;
+
+/* Fixed set of worker threads that run queued tasks. Opaque; see uthread_pool_create. */
+typedef struct uthread_pool uthread_pool_t;
+
+#define UTHREAD_MUTEX_INITIALIZER {0, 0, {0, 0}}
+#define UTHREAD_COND_INITIALIZER {{0, 0}}
 
 /* External interface */
 
@@ -29,13 +183,54 @@ typedef void (*thread_entry_point)(void);
 */
 int uthread_init(int quantum_usecs);
 
+/**
+ * @brief initializes the thread library like uthread_init, with the configuration in attr (NULL for defaults).
+ *
+ * attr->clock selects what a quantum measures. The CPU-time clocks (VIRTUAL, PROCESS_CPU) suit batch work: a thread
+ * doing I/O does not use up quanta while it waits. The wall-clock clocks (REAL, MONOTONIC) give latency-sensitive
+ * services time slices of fixed real length. POSIX timers deliver their signal to the calling kernel thread
+ * (SIGEV_THREAD_ID) where the platform supports it. With a wall-clock timer, quanta keep being counted while every
+ * thread is blocked, so uthread_sleep measures real time; with a CPU-time clock the library counts idle wall-clock
+ * time in quanta itself. UTHREAD_CLOCK_REAL takes over SIGALRM, so the application must not use alarm(2).
+ *
+ * attr->sched selects the scheduling policy. RR and MLFQ always run a thread of the highest priority level that
+ * has a READY thread, and a thread that becomes READY with a higher level than the running one preempts it at once.
+ * Under UTHREAD_SCHED_MLFQ a thread that is still running when its quantum expires drops one level, a thread that
+ * blocks or sleeps before that keeps its level, and every attr->mlfq_boost_quanta quanta all threads are raised back
+ * to their priority so that CPU-bound threads cannot starve. STRIDE and CFS ignore priorities and share the CPU in
+ * proportion to thread weights. STRIDE charges a whole quantum whenever a thread leaves the CPU, even if it blocked
+ * early; CFS charges the nanoseconds actually used and lets a thread that wakes from a long sleep run soon, though
+ * it does not preempt the running thread.
+ *
+ * With attr->tickless the timer is stopped while the running thread has nothing to switch to, or set to fire only
+ * when the next sleeping thread is due, and it is restarted as soon as a thread is spawned or woken. With
+ * attr->adaptive_quantum a thread whose quantum expires while it is still running gets twice as many quanta for its
+ * next turn, up to attr->adaptive_quantum, and goes back to one quantum once it blocks or sleeps before its turn
+ * ends; a running thread is cut back to the current quantum when such an interactive thread becomes READY. The
+ * timer then fires once per turn instead of once per quantum. In both modes the quanta that pass without a tick are
+ * still counted, so uthread_get_total_quantums, uthread_get_quantums and uthread_sleep behave as with a periodic
+ * timer. EDF threads (uthread_set_deadline) always get a periodic tick.
+ *
+ * With attr->workers > 1 the threads are run by that many kernel threads (M:N mode), the calling thread being the
+ * first of them. Each worker keeps its own run queue, appends the threads it makes READY to it, and steals from the
+ * others when its own is empty; all library calls still go through a single scheduler lock. M:N mode requires
+ * UTHREAD_CLOCK_MONOTONIC, UTHREAD_SCHED_RR and a periodic tick, with every worker having its own timer; priorities
+ * and weights have no effect, a thread that becomes READY never preempts a running one, and uthread_set_deadline
+ * fails. uthread_preempt_disable keeps other workers out of the library but not out of their threads' own code, so
+ * data shared between threads needs a uthread_mutex_t. A thread may resume on a different kernel thread after any
+ * library call or preemption, so it must not keep thread_local data or pthread_self() across them.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_init_ex(int quantum_usecs, const uthread_init_attr_t* attr);
+
 /**
  * @brief Creates a new thread, whose entry point is the function entry_point with the signature
  * void entry_point(void).
  *
  * The thread is added to the end of the READY threads list.
  * The uthread_spawn function should fail if it would cause the number of concurrent threads to exceed the
- * limit (MAX_THREAD_NUM).
+ * limit (MAX_THREAD_NUM unless changed with uthread_set_thread_limit).
  * Each thread should be allocated with a stack of size STACK_SIZE bytes.
  * It is an error to call this function with a null entry_point.
  *
@@ -43,6 +238,93 @@ int uthread_init(int quantum_usecs);
 */
 int uthread_spawn(thread_entry_point entry_point);
 
+/**
+ * @brief Creates a new thread like uthread_spawn, with the attributes in attr (NULL for defaults).
+ *
+ * The stack is reserved with mmap below a PROT_NONE guard page and memory is only committed as the thread touches
+ * it, so a large attr->stack_size costs address space rather than RAM. A thread that overflows into its guard page
+ * in its own code is reported on stderr and terminated, and the rest of the process keeps running; an overflow inside
+ * the library (in a critical section) is reported and then kills the process.
+ *
+ * @return On success, return the ID of the created thread. On failure, return -1.
+*/
+int uthread_spawn_ex(thread_entry_point entry_point, const uthread_attr_t* attr);
+
+/**
+ * @brief Creates a new thread like uthread_spawn, whose entry point entry_point is called with the argument arg.
+ *
+ * @return On success, return the ID of the created thread. On failure, return -1.
+*/
+int uthread_spawn_arg(thread_arg_entry_point entry_point, void* arg);
+
+/**
+ * @brief Sets the maximal number of concurrent threads, including the main thread.
+ *
+ * Thread control blocks and stacks are allocated in chunks as threads are spawned, so a high limit costs nothing
+ * until it is used. The limit may be changed at any time, before or after uthread_init. It is an error to set it
+ * below the number of live threads or above UTHREAD_THREAD_LIMIT_MAX.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_set_thread_limit(int limit);
+
+/**
+ * @brief Sets the priority of the thread with ID tid, from 0 (highest) to UTHREAD_PRIO_LEVELS - 1.
+ *
+ * A READY thread only runs when no thread of a higher priority is READY; threads of equal priority share the CPU
+ * round robin. Under UTHREAD_SCHED_MLFQ the priority is the level the thread starts at and returns to on every boost.
+ * The proportional-share policies ignore priorities. If no thread with ID tid exists it is considered an error.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_set_priority(int tid, int priority);
+
+/**
+ * @brief Sets the CPU share weight of the thread with ID tid, from 1 to UTHREAD_WEIGHT_MAX.
+ *
+ * Under UTHREAD_SCHED_STRIDE and UTHREAD_SCHED_CFS a thread that is READY as often as another one gets CPU time in
+ * proportion to its weight. The other policies ignore weights. If no thread with ID tid exists it is considered an
+ * error.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_set_weight(int tid, int weight);
+
+/**
+ * @brief Moves the thread with ID tid into the earliest-deadline-first real-time class, or back out of it.
+ *
+ * The thread gets budget quanta in every period of period quanta, starting with the current quantum. READY EDF
+ * threads always run before best-effort threads, the one with the earliest deadline (end of its current period)
+ * first, and one that becomes READY preempts any best-effort thread at once. Every quantum an EDF thread runs in
+ * uses one quantum of its budget; once the budget is spent the thread is held back until its next period. A new
+ * reservation is only admitted if the budget/period of all EDF threads adds up to at most 1. The job of a period
+ * counts as done once the thread blocks, sleeps or calls uthread_wait_next_period; a thread that is still runnable
+ * or out of budget when its period ends has missed its deadline. period == 0 returns the thread to its best-effort
+ * policy. It is an error to use the main thread (tid == 0), a nonexistent tid, or 0 < period < budget, or to set
+ * a reservation in M:N mode (uthread_init_ex with attr->workers > 1).
+ *
+ * @return On success, return 0. If admission control rejects the reservation, or on any other failure, return -1.
+*/
+int uthread_set_deadline(int tid, int period, int budget);
+
+/**
+ * @brief Ends the current period's job of the calling EDF thread: it sleeps until its next period starts.
+ *
+ * It is an error to call this function from a thread outside the EDF class.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_wait_next_period(void);
+
+/**
+ * @brief Returns the number of deadlines the thread with ID tid has missed since it joined the EDF class.
+ *
+ * If no thread with ID tid exists it is considered an error.
+ *
+ * @return On success, return the number of missed deadlines. On failure, return -1.
+*/
+int uthread_get_deadline_misses(int tid);
+
 
 /**
  * @brief Terminates the thread with ID tid and deletes it from all relevant control structures.
@@ -57,6 +339,41 @@ int uthread_spawn(thread_entry_point entry_point);
 int uthread_terminate(int tid);
 
 
+/**
+ * @brief Terminates the calling thread with the exit value value, which uthread_join hands to the thread joining it.
+ *
+ * Returning from the entry point, or being terminated with uthread_terminate, ends a thread with a NULL exit value.
+ * Called from the main thread, it ends the process like uthread_terminate(0).
+ *
+ * @return The function does not return.
+*/
+void uthread_exit(void* value);
+
+
+/**
+ * @brief Waits for the thread with ID tid to terminate and stores its exit value in *result, unless result is NULL.
+ *
+ * Only a thread spawned with attr->joinable set can be joined. The caller is BLOCKED until the thread terminates.
+ * A joinable thread that terminates before anyone joins it becomes a zombie: it keeps its tid, so that no new
+ * thread can be given that tid before uthread_join collects the exit value and releases it, but every other
+ * function treats it as gone. It is an error to join a thread that does not exist, is not joinable, is already being
+ * joined, is the caller, or is itself joining the caller.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_join(int tid, void** result);
+
+
+/**
+ * @brief Detaches the thread with ID tid: its tid is released as soon as it terminates, or at once if it is a zombie.
+ *
+ * It is an error to detach a thread that does not exist or that another thread is joining.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_detach(int tid);
+
+
 /**
  * @brief Blocks the thread with ID tid. The thread may be resumed later using uthread_resume.
  *
@@ -79,6 +396,25 @@ int uthread_block(int tid);
 */
 int uthread_resume(int tid);
 
+/**
+ * @brief Resumes the thread with ID tid like uthread_resume, but may be called from any kernel thread, including
+ * pthreads the library does not run, such as the completion callbacks of another library's thread pool.
+ *
+ * The call only queues the wakeup, with a few atomic operations: it takes no lock and never blocks. The scheduler
+ * delivers queued wakeups at its next scheduling point (the next tick or library call that switches threads), or at
+ * once if it has nothing to run. A wakeup resumes the thread only if it is blocked by uthread_block at that point,
+ * and several wakeups queued before one is delivered count as one. As a blocked thread may be resumed this way at
+ * any time, the library does not report a deadlock while some thread is blocked by uthread_block; with
+ * attr->tickless it also keeps the tick running. tid is only checked against the size of the thread table, so the
+ * caller must make sure that it still names the intended thread when the wakeup is delivered.
+ *
+ * A thread that hands a request to a foreign pthread and then blocks until it is done should do both with
+ * preemption disabled (uthread_preempt_disable), so that the wakeup cannot be delivered, and lost, in between.
+ *
+ * @return On success, return 0. If tid is out of range, return -1.
+*/
+int uthread_resume_from_foreign(int tid);
+
 
 /**
  * @brief Blocks the RUNNING thread for num_quantums quantums.
@@ -96,6 +432,37 @@ int uthread_resume(int tid);
 int uthread_sleep(int num_quantums);
 
 
+/**
+ * @brief Gives up the CPU: the calling thread goes back to READY, behind the threads already waiting under its
+ * scheduling policy, and the next thread runs.
+ *
+ * As when a thread blocks or sleeps, the next thread starts a new quantum, which uthread_get_total_quantums and that
+ * thread's uthread_get_quantums count. If no other thread is READY the caller keeps running and no quantum starts.
+ * STRIDE and CFS order threads by pass or virtual runtime rather than by arrival, so there the caller may be picked
+ * again right away.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_yield();
+
+
+/**
+ * @brief Switches straight to the READY thread with ID tid and hands it the rest of the current quantum.
+ *
+ * The calling thread goes back to READY as with uthread_yield, but tid runs next whatever the policy's order, so a
+ * producer can pass a request to its consumer without waiting for the other READY threads to take their turns. No
+ * new quantum starts: uthread_get_total_quantums stays the same and the timer is left alone, so tid is preempted
+ * when the caller's quantum (or adaptive turn) would have ended. tid's uthread_get_quantums still grows by one,
+ * since tid now runs in the current quantum. Threads handing the CPU back and forth this way therefore do not
+ * advance sleep deadlines or MLFQ boosts. Yielding to a thread that is not READY, or to the caller itself, has no
+ * effect and is not considered an error. If the caller or tid is an EDF thread the call acts like uthread_yield,
+ * so that deadlines keep their order. If no thread with ID tid exists it is considered an error.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_yield_to(int tid);
+
+
 /**
  * @brief Returns the thread ID of the calling thread.
  *
@@ -127,4 +494,349 @@ int uthread_get_total_quantums();
 int uthread_get_quantums(int tid);
 
 
+/**
+ * @brief Fills *stats with the scheduler statistics of the thread with ID tid.
+ *
+ * Counters start at zero when the thread is spawned; the time of a RUNNING or READY thread includes its current
+ * stretch. Timestamps come from the CPU's cycle counter (rdtsc, or cntvct_el0 on AArch64), so keeping the counters
+ * costs a few nanoseconds per switch and no system calls. If no thread with ID tid exists or stats is null it is
+ * considered an error.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_get_stats(int tid, uthread_stats_t* stats);
+
+
+/**
+ * @brief Fills *stats with a snapshot of the scheduler statistics of the whole library since uthread_init.
+ *
+ * It is an error to call this function with a null stats.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_get_global_stats(uthread_global_stats_t* stats);
+
+
+/**
+ * @brief Starts recording scheduling events into a ring buffer of nevents entries (rounded up to a power of two;
+ * 0 means 65536).
+ *
+ * The buffer is mapped once, here, and reused by later calls that fit in it; recording an event allocates nothing,
+ * takes no lock and makes no system call: it stores 16 bytes stamped with the CPU's cycle counter. When the ring
+ * is full the oldest events are overwritten. Restarting a trace discards the events recorded so far.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_trace_start(int nevents);
+
+
+/**
+ * @brief Stops recording scheduling events. The recorded events stay available to uthread_trace_dump.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_trace_stop(void);
+
+
+/**
+ * @brief Writes the recorded events to fd: a uthread_trace_header_t followed by the events, oldest first.
+ *
+ * Only write(2) is used, so a dump can be taken from a signal handler, e.g. when the process is about to crash.
+ * The trace2json tool turns a dump into Chrome trace JSON, which chrome://tracing and Perfetto open. It is an error
+ * to call this function before uthread_trace_start.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_trace_dump(int fd);
+
+
+/**
+ * @brief Disables preemption of the calling thread until the matching uthread_preempt_enable.
+ *
+ * Calls nest. While preemption is disabled a quantum expiry is deferred, not lost: the switch happens as soon as the
+ * outermost uthread_preempt_enable runs. A thread that blocks, sleeps or terminates still gives up the CPU; it gets
+ * back its disabled state when it runs again. Intended for short critical sections shared between threads.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_preempt_disable();
+
+
+/**
+ * @brief Re-enables preemption disabled by uthread_preempt_disable, taking any deferred preemption.
+ *
+ * It is an error to call this function when preemption is not disabled.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_preempt_enable();
+
+
+/*
+ * Synchronization primitives.
+ *
+ * Waiters are parked in the BLOCKED state on a FIFO queue inside the object and never spin. Releasing an object that
+ * has waiters hands it directly to the first one, which is moved to the end of the READY queue already owning it.
+ * A parked thread is not made READY by uthread_resume; it stays BLOCKED until the object is handed to it. Terminating
+ * a parked thread removes it from the queue. The try variants return 0 on success, 1 if the call would block and -1
+ * on error.
+ */
+
+
+/**
+ * @brief Initializes a mutex to the unlocked state.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_mutex_init(uthread_mutex_t* mutex);
+
+/**
+ * @brief Destroys a mutex. It is an error to destroy a locked mutex.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_mutex_destroy(uthread_mutex_t* mutex);
+
+/**
+ * @brief Locks a mutex, parking the calling thread until it is handed the lock if another thread holds it.
+ *
+ * It is an error to lock a mutex already held by the calling thread.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_mutex_lock(uthread_mutex_t* mutex);
+
+/**
+ * @brief Locks a mutex if it is free, without blocking.
+ *
+ * @return 0 if the lock was taken, 1 if it is held, -1 on error.
+*/
+int uthread_mutex_trylock(uthread_mutex_t* mutex);
+
+/**
+ * @brief Unlocks a mutex held by the calling thread, handing it to the first waiter if there is one.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_mutex_unlock(uthread_mutex_t* mutex);
+
+
+/**
+ * @brief Initializes a condition variable.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_cond_init(uthread_cond_t* cond);
+
+/**
+ * @brief Destroys a condition variable. It is an error to destroy a condition variable that has waiters.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_cond_destroy(uthread_cond_t* cond);
+
+/**
+ * @brief Atomically unlocks mutex and parks the calling thread on cond.
+ *
+ * The mutex must be held by the calling thread. When the thread is signalled it is queued for the mutex and only
+ * runs again once it holds it, so there are no wakeups that immediately block on the mutex.
+ *
+ * @return On success, return 0 with the mutex held again. On failure, return -1.
+*/
+int uthread_cond_wait(uthread_cond_t* cond, uthread_mutex_t* mutex);
+
+/**
+ * @brief Wakes the thread that has been waiting longest on cond, if any.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_cond_signal(uthread_cond_t* cond);
+
+/**
+ * @brief Wakes every thread waiting on cond.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_cond_broadcast(uthread_cond_t* cond);
+
+
+/**
+ * @brief Initializes a semaphore with a non-negative initial value.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_sem_init(uthread_sem_t* sem, int value);
+
+/**
+ * @brief Destroys a semaphore. It is an error to destroy a semaphore that has waiters.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_sem_destroy(uthread_sem_t* sem);
+
+/**
+ * @brief Decrements the semaphore, parking the calling thread while its value is zero.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_sem_wait(uthread_sem_t* sem);
+
+/**
+ * @brief Decrements the semaphore if its value is positive, without blocking.
+ *
+ * @return 0 if the semaphore was decremented, 1 if its value is zero, -1 on error.
+*/
+int uthread_sem_trywait(uthread_sem_t* sem);
+
+/**
+ * @brief Increments the semaphore, or hands the unit directly to the first waiter if there is one.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_sem_post(uthread_sem_t* sem);
+
+
+/*
+ * Channels.
+ *
+ * A channel passes void* messages between threads in FIFO order; the pointed-to data is never copied. When a receiver
+ * is already parked, a send hands the pointer straight to it. Otherwise the message is buffered, and a sender that
+ * finds the buffer full is parked BLOCKED until a receiver takes its message. Closing a channel wakes every parked
+ * sender and receiver; messages already buffered can still be received.
+ */
+
+
+/**
+ * @brief Creates a channel that buffers up to capacity messages.
+ *
+ * With capacity 0 every send waits for a matching receive (rendezvous).
+ *
+ * @return On success, return the new channel. On failure, return NULL.
+*/
+uthread_chan_t* uthread_chan_create(int capacity);
+
+/**
+ * @brief Destroys a channel and its buffer. It is an error to destroy a channel that has parked threads.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_chan_destroy(uthread_chan_t* chan);
+
+/**
+ * @brief Sends msg, parking the calling thread while the channel is full.
+ *
+ * @return On success, return 0. If the channel is or gets closed before msg is taken, return -1.
+*/
+int uthread_chan_send(uthread_chan_t* chan, void* msg);
+
+/**
+ * @brief Receives the oldest message into *msg, parking the calling thread while the channel is empty.
+ *
+ * @return On success, return 0. If the channel is closed and drained, return -1.
+*/
+int uthread_chan_recv(uthread_chan_t* chan, void** msg);
+
+/**
+ * @brief Sends msg if that can be done without blocking.
+ *
+ * @return 0 if msg was sent, 1 if the channel is full, -1 if it is closed or on error.
+*/
+int uthread_chan_try_send(uthread_chan_t* chan, void* msg);
+
+/**
+ * @brief Receives a message into *msg if one is available without blocking.
+ *
+ * @return 0 if a message was received, 1 if the channel is empty, -1 if it is closed and drained or on error.
+*/
+int uthread_chan_try_recv(uthread_chan_t* chan, void** msg);
+
+/**
+ * @brief Closes a channel. Further sends fail; parked senders and receivers are woken and fail.
+ *
+ * It is an error to close a channel twice.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_chan_close(uthread_chan_t* chan);
+
+
+/*
+ * Thread pools.
+ *
+ * A pool runs short tasks on a fixed set of worker threads that are spawned once and then recycled, so a task costs
+ * a queue push and pop instead of a thread spawn and termination, and runs on a stack that is already mapped and
+ * touched. Idle workers are parked BLOCKED on the pool; submitting a task wakes one. A task may block, sleep or
+ * do I/O, which only holds up its own worker, but must return rather than end its thread with uthread_exit or
+ * uthread_terminate.
+ */
+
+
+/**
+ * @brief Creates a pool of nthreads worker threads, which count against the thread limit like any other thread.
+ *
+ * @return On success, return the new pool. On failure, return NULL.
+*/
+uthread_pool_t* uthread_pool_create(int nthreads);
+
+/**
+ * @brief Queues the task fn(arg) on pool. The next idle worker runs it; the caller never blocks.
+ *
+ * It is an error to submit to a pool that is being destroyed, except from one of its own tasks.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_pool_submit(uthread_pool_t* pool, thread_arg_entry_point fn, void* arg);
+
+/**
+ * @brief Runs every task still queued on pool, then ends its workers and frees it.
+ *
+ * The caller is BLOCKED until the last worker has terminated. It is an error to destroy a pool from one of its own
+ * tasks.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_pool_destroy(uthread_pool_t* pool);
+
+
+/*
+ * Non-blocking I/O.
+ *
+ * These wrappers behave like the system calls they are named after, but when the call would block they park only
+ * the calling thread until epoll reports the fd ready, then retry. The fd must be in non-blocking mode (O_NONBLOCK);
+ * a blocking fd stalls every thread, as the plain system call does. Failures return -1 with errno set by the
+ * underlying call and are not reported on stderr.
+ */
+
+
+/**
+ * @brief Reads up to count bytes from fd into buf, parking the calling thread until data is available.
+ *
+ * @return The number of bytes read (0 at end of file), or -1 with errno set.
+*/
+ssize_t uthread_read(int fd, void* buf, size_t count);
+
+/**
+ * @brief Writes up to count bytes from buf to fd, parking the calling thread until fd accepts data.
+ *
+ * @return The number of bytes written, or -1 with errno set.
+*/
+ssize_t uthread_write(int fd, const void* buf, size_t count);
+
+/**
+ * @brief Accepts a connection on the listening socket sockfd, parking the calling thread until one arrives.
+ *
+ * The returned socket is already in non-blocking mode and close-on-exec.
+ *
+ * @return The new socket, or -1 with errno set.
+*/
+int uthread_accept(int sockfd, struct sockaddr* addr, socklen_t* addrlen);
+
+/**
+ * @brief Connects the socket sockfd to addr, parking the calling thread until the connection is established.
+ *
+ * @return On success, return 0. On failure, return -1 with errno set.
+*/
+int uthread_connect(int sockfd, const struct sockaddr* addr, socklen_t addrlen);
+
+
 #endif